@@ -0,0 +1,151 @@
+/*
+ * Description: micro-benchmark harness of the library. Every case builds
+ * a network of a given shape, feeds random samples through
+ * feed_forward_net and train_epoch, and reports the time per sample and
+ * the GFLOP/s of both. The hardware counters of the instrumentation layer
+ * are enabled, so every layer also gets its IPC, cache misses per 1000
+ * instructions and DRAM bytes per FLOP, or a note when the machine
+ * doesn't expose them. The timed loops run under the counting allocator
+ * and abort if a steady-state forward pass or training epoch allocates.
+ * The times and GFLOP/s come from separate runs without instrumentation.
+ * The FLOPs come from the static cost model. Its table is printed with
+ * latencies estimated from the kernel throughput that
+ * calibrate_throughput measured once on a reference net, so the estimate
+ * can be checked against the measured time of every case.
+ *
+ * Usage: benchmark [-r repetitions] [-j]   (-j prints one JSON object per case)
+ *
+ */
+
+#include "perceptron.h"
+
+#define N_SAMPLES 1024
+
+
+typedef struct BenchCase {
+    const char *name;
+    int in, hidden, out;
+    Activation hidden_act, out_act;
+} BenchCase;
+
+
+static const BenchCase cases[] = {
+    {"spiral 8-6-1", 8, 6, 1, ACT_SIGMOID, ACT_SIGMOID},
+    {"wine 11-32-1", 11, 32, 1, ACT_SIGMOID, ACT_SIGMOID},
+    {"relu 64-256-10", 64, 256, 10, ACT_RELU, ACT_SOFTMAX},
+    {"wide 512-1024-10", 512, 1024, 10, ACT_SIGMOID, ACT_SOFTMAX}
+};
+
+
+static void run_case(const BenchCase *bc, int reps, int json, double cal_forward, double cal_train) {
+    Dim in = {bc->in, bc->hidden};
+    Dim out = {bc->hidden, bc->out};
+    Dim dim = {N_SAMPLES, bc->in};
+    NeuralNet *ann = create_net_act(in, out, bc->hidden_act, bc->out_act);
+    float **X = allocate_float_2d(N_SAMPLES, bc->in);
+    float **y = allocate_float_2d(N_SAMPLES, 1);
+    for (int i = 0; i < N_SAMPLES; ++i) {
+        for (int j = 0; j < bc->in; ++j)
+            X[i][j] = rand_float();
+        y[i][0] = (float) (tann_rand() % (uint32_t) (bc->out > 1 ? bc->out : 2));
+    }
+    NetCost cost;
+    net_cost(ann, &cost);
+
+    /* Warm-up, also brings the weights into the caches */
+    float J, acc;
+    for (int i = 0; i < N_SAMPLES; ++i)
+        feed_forward_net(ann, X[i]);
+
+    /* Timed without instrumentation */
+    double start = wall_time();
+    for (int r = 0; r < reps; ++r)
+        for (int i = 0; i < N_SAMPLES; ++i)
+            feed_forward_net(ann, X[i]);
+    double forward_sec = wall_time() - start;
+
+    start = wall_time();
+    for (int r = 0; r < reps; ++r)
+        train_epoch(ann, X, y, dim, &J, &acc);
+    double train_sec = wall_time() - start;
+
+    /* Counters and the allocation check on separate runs */
+    tann_alloc_counter counter;
+    tann_alloc_counter_start(&counter);
+
+    tann_stats forward;
+    tann_stats_reset(&forward);
+    tann_stats_enable_perf(&forward);
+    tann_stats_attach(&forward);
+    for (int r = 0; r < reps; ++r)
+        for (int i = 0; i < N_SAMPLES; ++i)
+            TANN_ASSERT_NO_ALLOC(&counter, feed_forward_net(ann, X[i]));
+    tann_stats_attach(NULL);
+
+    tann_stats train;
+    tann_stats_reset(&train);
+    tann_stats_enable_perf(&train);
+    tann_stats_attach(&train);
+    for (int r = 0; r < reps; ++r)
+        TANN_ASSERT_NO_ALLOC(&counter, train_epoch(ann, X, y, dim, &J, &acc));
+    tann_stats_attach(NULL);
+    tann_alloc_counter_stop(&counter);
+
+    long n = (long) reps * N_SAMPLES;
+    double forward_ns = forward_sec * 1e9 / (double) n;
+    double train_ns = train_sec * 1e9 / (double) n;
+    double forward_gflops = cost.total.forward_flops * (double) n / forward_sec * 1e-9;
+    double train_gflops = (cost.total.forward_flops + cost.total.backward_flops) * (double) n / train_sec * 1e-9;
+
+    if (json) {
+        printf("{\"case\": \"%s\", \"forward_ns\": %f, \"forward_gflops\": %f, \"train_ns\": %f, "
+               "\"train_gflops\": %f, \"forward_stats\": ", bc->name, forward_ns, forward_gflops, train_ns, train_gflops);
+        tann_stats_print_json(stdout, &forward);
+        printf(", \"train_stats\": ");
+        tann_stats_print_json(stdout, &train);
+        printf(", \"cost\": ");
+        print_net_cost_json(stdout, &cost, cal_forward, cal_train);
+        printf("}\n");
+    } else {
+        printf("\n=== %s ===\n", bc->name);
+        printf("Forward:  %10.1f ns/sample   %6.2f GFLOP/s\n", forward_ns, forward_gflops);
+        printf("Train:    %10.1f ns/sample   %6.2f GFLOP/s\n", train_ns, train_gflops);
+        printf("Forward pass counters\n");
+        tann_stats_print_perf(stdout, &forward, ann);
+        printf("Training counters\n");
+        tann_stats_print_perf(stdout, &train, ann);
+        printf("Cost model at the calibrated throughput\n");
+        print_net_cost(stdout, &cost, cal_forward, cal_train);
+    }
+
+    free_net(ann);
+    free_float_2d(X, N_SAMPLES);
+    free_float_2d(y, N_SAMPLES);
+}
+
+
+int main(int argc, char **argv) {
+    int reps = 5, json = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0)
+            json = 1;
+    }
+    if (reps < 1)
+        reps = 1;
+
+    double cal_forward, cal_train;
+    tann_seed(42);
+    calibrate_throughput(&cal_forward, &cal_train);
+    if (json)
+        printf("{\"calibrated_forward_gflops\": %f, \"calibrated_train_gflops\": %f}\n", cal_forward, cal_train);
+    else
+        printf("Calibrated kernel throughput: forward %0.2f GFLOP/s   train %0.2f GFLOP/s\n", cal_forward, cal_train);
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+        run_case(&cases[c], reps, json, cal_forward, cal_train);
+
+    tann_stats_disable_perf();
+    return 0;
+}
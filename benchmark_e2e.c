@@ -0,0 +1,294 @@
+/*
+ * Description: end-to-end benchmark of the library on the bundled wine
+ * and titanic datasets. Every case runs the whole pipeline of
+ * example_wine.c and example_titanic.c: it reads the CSV file, scales the
+ * features, trains the network until the test accuracy reaches a target
+ * (or a maximum number of epochs passes) and evaluates it. The time and
+ * throughput of every stage are reported next to the wall time to the
+ * target accuracy and the peak resident memory of the case, and the
+ * last line sums the time to accuracy of all cases into one number.
+ * Every run happens in a child process of its own, so the peak memory of
+ * one case doesn't carry over into the next.
+ * Every case is repeated with the same seed and the fastest run of every
+ * stage is kept, so the numbers don't jump with the load of the machine.
+ * The trained net is also quantized to Q15 and Q7 and the accuracy of
+ * the fixed-point nets is reported next to the float one. To check
+ * on-device training, the float net and its Q15 copy are then fine-tuned
+ * side by side for a few epochs, with train_epoch and qnet_train_sample.
+ *
+ * Usage: benchmark_e2e [data directory] [-r repetitions] [-j]
+ *        (default: data and 5 repetitions, -j prints one JSON object per case)
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "perceptron.h"
+
+/* Epochs of the side by side fine-tuning of the float and the Q15 net */
+#define FINETUNE_EPOCHS 3
+
+
+typedef struct E2ECase {
+    const char *name;
+    const char *file;
+    Dim train_dim, test_dim;
+    int hidden;
+    float label_threshold; /* labels at or above it are positive, 0 keeps them as they are */
+    float target_accuracy; /* test accuracy that stops the training */
+    int max_epoch;
+} E2ECase;
+
+
+static const E2ECase cases[] = {
+    /* Predicting the majority class gives 0.925 on wine and 0.632 on titanic */
+    {"wine", "wine_data.csv", {1280, 11}, {318, 11}, 6, 7, 0.935f, 200},
+    {"titanic", "titanic_data.csv", {700, 17}, {190, 17}, 4, 0, 0.84f, 200}
+};
+
+
+typedef struct E2EResult {
+    double load_sec, scale_sec, train_sec, eval_sec;
+    double time_to_accuracy; /* -1 if the target was never reached */
+    int epochs;
+    float accuracy; /* final test accuracy */
+    long peak_rss_kb;
+    QNetReport q15, q7; /* fixed-point copies of the trained net on the test set */
+    QNetReport q15_tuned; /* the Q15 copy and the float net after fine-tuning both */
+} E2EResult;
+
+
+/* Peak resident set size of the process in kilobytes, run_forked makes it the peak of one case */
+static long peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return usage.ru_maxrss;
+}
+
+
+/* Fine-tunes ann with train_epoch and a Q15 copy of it with qnet_train_sample on the same
+ * samples, then compares the two nets on the test set */
+static void finetune_side_by_side(NeuralNet *ann, float **X_train, float **y_train, Dim train_dim,
+                                  float **X_test, float **y_test, Dim test_dim, QNetReport *rep) {
+    QNet *q = quantize_net(ann, Q15, X_train, train_dim.h);
+    int16_t *qx = (int16_t*) tann_alloc(sizeof(int16_t) * train_dim.w);
+    int16_t *qy = (int16_t*) tann_alloc(sizeof(int16_t) * ann->output->dim.w);
+
+    for (int e = 0; e < FINETUNE_EPOCHS; ++e) {
+        float J, acc;
+        train_epoch(ann, X_train, y_train, train_dim, &J, &acc);
+        for (int i = 0; i < train_dim.h; ++i) {
+            qnet_quantize_input(q, X_train[i], qx);
+            if (qnet_quantize_target(q, y_train[i], qy) != 0)
+                continue;
+            qnet_forward(q, qx);
+            qnet_train_sample(q, qx, qy);
+        }
+    }
+    qnet_validate(q, ann, X_test, y_test, test_dim, rep);
+
+    tann_free(qx);
+    tann_free(qy);
+    free_qnet(q);
+}
+
+
+/* Runs the pipeline of a dataset, returns -1 if its file can't be opened */
+static int run_case(const E2ECase *ec, const char *data_dir, E2EResult *res) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", data_dir, ec->file);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return -1;
+    }
+    memset(res, 0, sizeof(E2EResult));
+    res->time_to_accuracy = -1;
+    Dim train_dim = ec->train_dim, test_dim = ec->test_dim;
+
+    double start = wall_time();
+    float **X_train = allocate_float_2d(train_dim.h, train_dim.w);
+    float **X_test = allocate_float_2d(test_dim.h, test_dim.w);
+    float **y_train = allocate_float_2d(train_dim.h, 1);
+    float **y_test = allocate_float_2d(test_dim.h, 1);
+    read_csv(file, X_train, X_test, y_train, y_test, train_dim, test_dim);
+    fclose(file);
+    if (ec->label_threshold > 0) {
+        for (int i = 0; i < train_dim.h; ++i)
+            y_train[i][0] = y_train[i][0] >= ec->label_threshold;
+        for (int i = 0; i < test_dim.h; ++i)
+            y_test[i][0] = y_test[i][0] >= ec->label_threshold;
+    }
+    res->load_sec = wall_time() - start;
+
+    start = wall_time();
+    standard_scaler(X_train, train_dim);
+    standard_scaler(X_test, test_dim);
+    res->scale_sec = wall_time() - start;
+
+    /* The clock of the time to accuracy doesn't stop for the evaluation after every epoch */
+    Dim in = {train_dim.w, ec->hidden};
+    Dim out = {ec->hidden, 1};
+    NeuralNet *ann = create_net(in, out);
+    EvalResult eval;
+    double train_start = wall_time();
+    for (res->epochs = 1; res->epochs <= ec->max_epoch; ++res->epochs) {
+        float J, acc;
+        start = wall_time();
+        train_epoch(ann, X_train, y_train, train_dim, &J, &acc);
+        res->train_sec += wall_time() - start;
+
+        start = wall_time();
+        eval_net(ann, X_test, y_test, test_dim, 1, &eval);
+        res->eval_sec += wall_time() - start;
+        if (eval.accuracy >= ec->target_accuracy) {
+            res->time_to_accuracy = wall_time() - train_start;
+            break;
+        }
+    }
+    if (res->epochs > ec->max_epoch)
+        res->epochs = ec->max_epoch;
+    res->accuracy = eval.accuracy;
+    res->peak_rss_kb = peak_rss_kb();
+
+    QNet *q = quantize_net(ann, Q15, X_train, train_dim.h);
+    qnet_validate(q, ann, X_test, y_test, test_dim, &res->q15);
+    free_qnet(q);
+    q = quantize_net(ann, Q7, X_train, train_dim.h);
+    qnet_validate(q, ann, X_test, y_test, test_dim, &res->q7);
+    free_qnet(q);
+    finetune_side_by_side(ann, X_train, y_train, train_dim, X_test, y_test, test_dim, &res->q15_tuned);
+
+    free_net(ann);
+    free_float_2d(X_train, train_dim.h);
+    free_float_2d(X_test, test_dim.h);
+    free_float_2d(y_train, train_dim.h);
+    free_float_2d(y_test, test_dim.h);
+    return 0;
+}
+
+
+/* Runs a case in a child process and reads its result back through a pipe, returns -1 on failure */
+static int run_forked(const E2ECase *ec, const char *data_dir, E2EResult *res) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        int ok = run_case(ec, data_dir, res) == 0 && write(fds[1], res, sizeof(E2EResult)) == sizeof(E2EResult);
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t n = read(fds[0], res, sizeof(E2EResult));
+    close(fds[0]);
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return n == sizeof(E2EResult) ? 0 : -1;
+}
+
+
+/* Keeps the fastest time of every stage, the runs only differ in timing */
+static void keep_fastest(E2EResult *best, const E2EResult *run) {
+    best->load_sec = fmin(best->load_sec, run->load_sec);
+    best->scale_sec = fmin(best->scale_sec, run->scale_sec);
+    best->train_sec = fmin(best->train_sec, run->train_sec);
+    best->eval_sec = fmin(best->eval_sec, run->eval_sec);
+    if (run->time_to_accuracy >= 0 && (best->time_to_accuracy < 0 || run->time_to_accuracy < best->time_to_accuracy)) {
+        best->time_to_accuracy = run->time_to_accuracy;
+        best->epochs = run->epochs;
+        best->accuracy = run->accuracy;
+    }
+    if (run->peak_rss_kb > best->peak_rss_kb)
+        best->peak_rss_kb = run->peak_rss_kb;
+    best->q15 = run->q15;
+    best->q7 = run->q7;
+    best->q15_tuned = run->q15_tuned;
+}
+
+
+static void print_result(const E2ECase *ec, const E2EResult *res, int json) {
+    int rows = ec->train_dim.h + ec->test_dim.h;
+    double train_rate = (double) ec->train_dim.h * res->epochs / res->train_sec;
+    double eval_rate = (double) ec->test_dim.h * res->epochs / res->eval_sec;
+    if (json) {
+        printf("{\"case\": \"%s\", \"time_to_accuracy\": %f, \"target_accuracy\": %f, \"accuracy\": %f, "
+               "\"epochs\": %d, \"load_sec\": %f, \"load_rows_per_sec\": %f, \"scale_sec\": %f, "
+               "\"scale_rows_per_sec\": %f, \"train_sec\": %f, \"train_samples_per_sec\": %f, "
+               "\"eval_sec\": %f, \"eval_samples_per_sec\": %f, \"peak_rss_kb\": %ld, "
+               "\"q15_accuracy\": %f, \"q15_agreement\": %f, \"q7_accuracy\": %f, \"q7_agreement\": %f, "
+               "\"finetuned_float_accuracy\": %f, \"finetuned_q15_accuracy\": %f, \"finetuned_agreement\": %f}\n",
+               ec->name, res->time_to_accuracy, ec->target_accuracy, res->accuracy, res->epochs,
+               res->load_sec, rows / res->load_sec, res->scale_sec, rows / res->scale_sec,
+               res->train_sec, train_rate, res->eval_sec, eval_rate, res->peak_rss_kb,
+               res->q15.fixed_accuracy, res->q15.agreement, res->q7.fixed_accuracy, res->q7.agreement,
+               res->q15_tuned.float_accuracy, res->q15_tuned.fixed_accuracy, res->q15_tuned.agreement);
+        return;
+    }
+
+    printf("\n=== %s ===\n", ec->name);
+    if (res->time_to_accuracy >= 0)
+        printf("Time to %0.3f accuracy: %0.3f sec (%d epochs)\n", ec->target_accuracy, res->time_to_accuracy, res->epochs);
+    else
+        printf("Target accuracy %0.3f not reached in %d epochs\n", ec->target_accuracy, res->epochs);
+    printf("Final test accuracy: %f\n", res->accuracy);
+    printf("Load:   %8.4f sec   %12.0f rows/sec\n", res->load_sec, rows / res->load_sec);
+    printf("Scale:  %8.4f sec   %12.0f rows/sec\n", res->scale_sec, rows / res->scale_sec);
+    printf("Train:  %8.4f sec   %12.0f samples/sec\n", res->train_sec, train_rate);
+    printf("Eval:   %8.4f sec   %12.0f samples/sec\n", res->eval_sec, eval_rate);
+    printf("Peak RSS: %ld KB\n", res->peak_rss_kb);
+    printf("Q15: accuracy %f   agreement %f   max output error %f\n",
+           res->q15.fixed_accuracy, res->q15.agreement, res->q15.max_abs_err);
+    printf("Q7:  accuracy %f   agreement %f   max output error %f\n",
+           res->q7.fixed_accuracy, res->q7.agreement, res->q7.max_abs_err);
+    printf("Fine-tuned %d epochs: float accuracy %f   Q15 on-device accuracy %f   agreement %f\n", FINETUNE_EPOCHS,
+           res->q15_tuned.float_accuracy, res->q15_tuned.fixed_accuracy, res->q15_tuned.agreement);
+}
+
+
+int main(int argc, char **argv) {
+    const char *data_dir = "data";
+    int reps = 5, json = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0)
+            json = 1;
+        else
+            data_dir = argv[i];
+    }
+    if (reps < 1)
+        reps = 1;
+
+    /* A missed target counts as the whole training time, so it still shows up as a regression */
+    double total = 0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        E2EResult res, run;
+        for (int r = 0; r < reps; ++r) {
+            tann_seed(42);
+            if (run_forked(&cases[c], data_dir, r == 0 ? &res : &run) != 0)
+                return 1;
+            if (r > 0)
+                keep_fastest(&res, &run);
+        }
+        print_result(&cases[c], &res, json);
+        total += res.time_to_accuracy >= 0 ? res.time_to_accuracy : res.train_sec + res.eval_sec;
+    }
+
+    if (json)
+        printf("{\"total_time_to_accuracy\": %f}\n", total);
+    else
+        printf("\nTotal time to accuracy: %0.3f sec\n", total);
+    return 0;
+}
@@ -12,7 +12,7 @@
 #include "perceptron.h"
 
 int main(int argc, char **argv) {
-    srand(time(NULL));
+    tann_seed(time(NULL));
     SDL_Renderer *renderer;
     SDL_Window *window;
 
@@ -15,7 +15,7 @@
 
 
 int main(int argc, char **argv) {
-    srand(time(NULL));
+    tann_seed(time(NULL));
     SDL_Renderer *renderer;
     SDL_Window *window;
 
@@ -23,18 +23,140 @@ float dist(float ax, float ay, float bx, float by) {
 }
 
 
-/* Sigmioid activation function */
-float sigmoid(float x) {
-    return (float) (1.0 / (1.0 + exp((double) -(x - (float) 0.5))));
-}
-
-
 /* Derivative of sigmoid */
 float sigmoid_der(float x) {
     return x * (1 - x);
 }
 
 
+/* Numerically stable softmax of an array */
+void softmax(const float *z, float *p, int n) {
+    float max = z[0];
+    for (int i = 1; i < n; ++i)
+        if (z[i] > max)
+            max = z[i];
+
+    float s = 0;
+    for (int i = 0; i < n; ++i) {
+        p[i] = expf(z[i] - max);
+        s += p[i];
+    }
+
+    float inv = 1 / s;
+    for (int i = 0; i < n; ++i)
+        p[i] *= inv;
+}
+
+
+/* Applies an activation function on n weighted inputs */
+void activate(Activation act, const float *in, float *out, int n) {
+    switch (act) {
+        case ACT_SOFTMAX:
+            softmax(in, out, n);
+            break;
+        case ACT_RELU:
+            for (int k = 0; k < n; ++k)
+                out[k] = in[k] > 0 ? in[k] : 0;
+            break;
+        case ACT_LEAKY_RELU:
+            for (int k = 0; k < n; ++k)
+                out[k] = in[k] > 0 ? in[k] : TANN_LEAKY_SLOPE * in[k];
+            break;
+        case ACT_TANH:
+            for (int k = 0; k < n; ++k)
+                out[k] = tanhf(in[k]);
+            break;
+        case ACT_LINEAR:
+            if (out != in)
+                memcpy(out, in, sizeof(float) * n);
+            break;
+        default:
+            for (int k = 0; k < n; ++k)
+                out[k] = sigmoid(in[k]);
+            break;
+    }
+}
+
+
+/* Multiplies backpropagated errors by the derivative of the activation. Every
+ * derivative is written in terms of the output, so the weighted inputs aren't needed. */
+void activation_delta(Activation act, const float *out, float *delta, int n) {
+    switch (act) {
+        case ACT_SIGMOID:
+            for (int k = 0; k < n; ++k)
+                delta[k] *= out[k] * (1 - out[k]);
+            break;
+        case ACT_RELU:
+            for (int k = 0; k < n; ++k)
+                delta[k] = out[k] > 0 ? delta[k] : 0;
+            break;
+        case ACT_LEAKY_RELU:
+            for (int k = 0; k < n; ++k)
+                delta[k] *= out[k] > 0 ? 1 : TANN_LEAKY_SLOPE;
+            break;
+        case ACT_TANH:
+            for (int k = 0; k < n; ++k)
+                delta[k] *= 1 - out[k] * out[k];
+            break;
+        default:
+            /* Linear, and softmax whose delta comes from softmax_cross_entropy */
+            break;
+    }
+}
+
+
+/* Name of an activation function */
+const char *activation_name(Activation act) {
+    switch (act) {
+        case ACT_SIGMOID:
+            return "sigmoid";
+        case ACT_SOFTMAX:
+            return "softmax";
+        case ACT_RELU:
+            return "relu";
+        case ACT_LEAKY_RELU:
+            return "leaky_relu";
+        case ACT_TANH:
+            return "tanh";
+        case ACT_LINEAR:
+            return "linear";
+    }
+    return "unknown";
+}
+
+
+/* Fused softmax and cross-entropy: writes the probabilities and the
+ * delta (one hot label minus probabilities), returns the loss. Returns -1
+ * with a zero delta if the label is not one of the n classes. */
+float softmax_cross_entropy(const float *z, float *p, float *delta, int n, int label) {
+    if (label < 0 || label >= n) {
+        fill_zero(delta, n);
+        return -1;
+    }
+
+    float max = z[0];
+    for (int i = 1; i < n; ++i)
+        if (z[i] > max)
+            max = z[i];
+
+    float s = 0;
+    for (int i = 0; i < n; ++i) {
+        p[i] = expf(z[i] - max);
+        s += p[i];
+    }
+
+    float inv = 1 / s;
+    for (int i = 0; i < n; ++i) {
+        p[i] *= inv;
+        delta[i] = -p[i];
+    }
+    delta[label] += 1;
+
+    /* -log(p[label]) taken from the logits so it never becomes infinite */
+    return logf(s) - (z[label] - max);
+}
+
+
 /* Sum of the elements of an array */
 float sum(const float *v, int n) {
     float s = 0.0;
@@ -64,7 +186,7 @@ void swap_float(float *a, float *b) {
 /* Shuffle the elements of a float array */
 void shuffle(float *v, int n) {
     for (int i = 0; i < n - 2; ++i) {
-        int j = rand() % (n - i) + i;
+        int j = (int) (tann_rand() % (uint32_t) (n - i)) + i;
         swap_float(&v[i], &v[j]);
     }
 }
@@ -72,7 +194,7 @@ void shuffle(float *v, int n) {
 
 /* Dynamically allocating memory for an float type array */
 float *allocate_float_1d(int n) {
-    float *v = (float*) malloc(sizeof(float) * n);
+    float *v = (float*) tann_alloc(sizeof(float) * n);
     return v;
 }
 
@@ -80,22 +202,23 @@ float *allocate_float_1d(int n) {
 /* Dynamically allocating memorty for a 2d array */
 float **allocate_float_2d(int n, int m) {
     float **X;
-    X = (float**) malloc(sizeof(float*) * n);
-    for (int i = 0; i < n; ++i)
-        X[i] = (float*) malloc(m * sizeof(float));
+    X = (float**) tann_alloc(sizeof(float*) * n);
+    for (int i = 0; i < n; ++i) {
+        X[i] = (float*) tann_alloc(m * sizeof(float));
+    }
     return X;
 }
 
 
 /* Free function for a 1d array */
 void free_float_1d(float *v) {
-    free(v);
+    tann_free(v);
 }
 
 
 /* Gets the ith row from the transpose of a matrix */
 float *get_row(float **v, int h, int idx) {
-    float *t = (float*) malloc(sizeof(float) * h);
+    float *t = (float*) tann_alloc(sizeof(float) * h);
     for (int i = 0; i < h; ++i) {
         t[i] = v[i][idx];
     }
@@ -104,6 +227,52 @@ float *get_row(float **v, int h, int idx) {
 }
 
 
+/* Allocates an empty CSR matrix with room for nnz non-zero elements */
+SparseMatrix *create_csr(Dim dim, int nnz) {
+    SparseMatrix *m = (SparseMatrix*) tann_alloc(sizeof(SparseMatrix));
+    m->dim = dim;
+    m->nnz = nnz;
+    m->row_ptr = (int*) tann_calloc(dim.h + 1, sizeof(int));
+    m->col = (int*) tann_alloc(sizeof(int) * (nnz > 0 ? nnz : 1));
+    m->val = allocate_float_1d(nnz > 0 ? nnz : 1);
+    return m;
+}
+
+
+/* Converts a dense matrix into CSR format, keeping the non-zero elements only */
+SparseMatrix *dense_to_csr(float **X, Dim dim) {
+    int nnz = 0;
+    for (int i = 0; i < dim.h; ++i)
+        for (int j = 0; j < dim.w; ++j)
+            if (X[i][j] != 0)
+                ++nnz;
+
+    SparseMatrix *m = create_csr(dim, nnz);
+    int p = 0;
+    for (int i = 0; i < dim.h; ++i) {
+        m->row_ptr[i] = p;
+        for (int j = 0; j < dim.w; ++j) {
+            if (X[i][j] != 0) {
+                m->col[p] = j;
+                m->val[p] = X[i][j];
+                ++p;
+            }
+        }
+    }
+    m->row_ptr[dim.h] = p;
+    return m;
+}
+
+
+/* Free function for a CSR matrix */
+void free_csr(SparseMatrix *m) {
+    tann_free(m->row_ptr);
+    tann_free(m->col);
+    tann_free(m->val);
+    tann_free(m);
+}
+
+
 /* Looks for the min and max elements */
 void mini_max(float *v, int n, float *max, float *min) {
     *max = v[0];
@@ -121,9 +290,9 @@ void mini_max(float *v, int n, float *max, float *min) {
 /* Free function for a 2d array */
 void free_float_2d(float **v, int n) {
     for (int i = 0; i < n; ++i) {
-        free(v[i]);
+        tann_free(v[i]);
     }
-    free(v);
+    tann_free(v);
 }
 
 
@@ -143,7 +312,7 @@ void fill_one(float *v, int n) {
 
 /* creates arandom float between 0 and 1 */
 float rand_float() {
-    return (float) rand() / (float) RAND_MAX;
+    return tann_rng_float(tann_thread_rng());
 }
 
 
@@ -191,9 +360,9 @@ void minmax_scaler(float **v, Dim dim) {
 /* CSV Reader especially for this example */
 void read_csv(FILE *file, float **X_train, float **X_test, float **y_train, float **y_test,
               Dim train_dim, Dim test_dim) {
-    char line[200 + 1];
+    char line[1000 + 1];
     int cnt = 0;
-    while ((fgets(line, 1000, file) != NULL) && (cnt < train_dim.h)) {
+    while ((fgets(line, sizeof(line), file) != NULL) && (cnt < train_dim.h)) {
         int idx;
         char *p;
         for (p = strtok(line, ","), idx = -1; p && *p && idx < train_dim.w; p = strtok(NULL, ","), ++idx) {
@@ -213,7 +382,7 @@ void read_csv(FILE *file, float **X_train, float **X_test, float **y_train, floa
 
     // Reading in the testing datasets
     cnt = 0;
-    while ((fgets(line, 1000, file) != NULL) && (cnt < test_dim.h)) {
+    while ((fgets(line, sizeof(line), file) != NULL) && (cnt < test_dim.h)) {
         int idx;
         char *p;
         for (p = strtok(line, ","), idx = -1; p && *p && idx < test_dim.w; p = strtok(NULL, ","), ++idx) {
@@ -274,7 +443,7 @@ void create_clusters(float **X, float **y, int n) {
 }
 
 void create_circles(float **X, float **y, int n) {
-    int class = rand() % 2;
+    int class = tann_rand() % 2;
     int ok = 0;
     while (ok < n) {
         float a = rand_float();
@@ -303,35 +472,23 @@ void create_circles(float **X, float **y, int n) {
 void create_spiral(float **X, float **y, int n) {
     float a = 0, b = 0.4;
     for (int i = 0; i < n; ++i) {
-        if (rand() % 2 == 0) {
-            float t = (float) i / ((float) n);
-            X[i][0] = 1;
-            X[i][1] = (float) 0.5 + (a + b * t) * (float) cos((double) t * 10);
-            X[i][2] = (float) 0.5 + (a + b * t) * (float) sin((double) t * 10);
-            X[i][3] = (float) sin((double) X[i][1] * 10);
-            X[i][4] = (float) sin((double) X[i][2] * 10);
-            X[i][5] = X[i][2] * X[i][1];
-            X[i][6] = X[i][1] * X[i][1];
-            X[i][7] = X[i][2] * X[i][2];
-            y[i][0] = 0;
-        } else {
-            float t = (float) i / ((float) n);
-            X[i][0] = 1;
-            X[i][1] = (float) 0.5 - (a + b * t) * (float) cos((double) t * 10);
-            X[i][2] = (float) 0.5 - (a + b * t) * (float) sin((double) t * 10);
-            X[i][3] = (float) sin((double) (X[i][1] * 10));
-            X[i][4] = (float) sin((double) (X[i][2] * 10));
-            X[i][5] = X[i][2] * X[i][1];
-            X[i][6] = X[i][1] * X[i][1];
-            X[i][7] = X[i][2] * X[i][2];
-            y[i][0] = 1;
-        }
+        float t = (float) i / ((float) n);
+        float sign = tann_rand() % 2 == 0 ? 1 : -1;
+        X[i][0] = 1;
+        X[i][1] = (float) 0.5 + sign * (a + b * t) * (float) cos((double) t * 10);
+        X[i][2] = (float) 0.5 + sign * (a + b * t) * (float) sin((double) t * 10);
+        y[i][0] = sign < 0;
     }
+
+    /* The remaining features are expanded by the shared spiral pipeline */
+    FeaturePipeline *fp = spiral_features();
+    feature_pipeline_apply(fp, X, X, n);
+    free_feature_pipeline(fp);
 }
 
 void create_chesstable(float **X, float **y, int n, float dist) {
     int ok = 0;
-    int class = rand() % 2;
+    int class = tann_rand() % 2;
 
     while (ok < n) {
         float a = rand_float();
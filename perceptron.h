@@ -25,8 +25,82 @@
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#ifndef TANN_NO_SDL /* Define TANN_NO_SDL to build without the plotter, like tinyann_serve */
 #include <SDL2/SDL.h> //Remove these if you don't want to use SDL
 #include <SDL2/SDL2_gfxPrimitives.h> //Remove these if you don't want to use SDL
+#endif
+
+
+/* Thread local storage for per-thread library state */
+#if defined(_MSC_VER)
+#define TANN_THREAD_LOCAL __declspec(thread)
+#else
+#define TANN_THREAD_LOCAL __thread
+#endif
+
+/* Maximum number of layers tracked by the instrumentation */
+#define TANN_MAX_LAYERS 16
+
+/* Number of hardware counters collected per layer */
+#define TANN_PERF_EVENTS 5
+
+/* Threads that can read through one ModelHandle at the same time */
+#define TANN_MAX_READERS 64
+
+/* Weight of the old value in the moving average of the partial_fit loss */
+#define TANN_LOSS_DECAY 0.99f
+
+/* Slope of ACT_LEAKY_RELU for negative inputs */
+#define TANN_LEAKY_SLOPE 0.01f
+
+/* Multiply-adds a layer needs before feed_forward_net splits it on the thread pool */
+#define TANN_PARALLEL_MIN_WORK 32768
+
+/* Number of consecutive outputs stored together by the sparse inference kernel */
+#define TANN_PRUNE_BLOCK 4
+
+/* Size of the confusion matrix and number of ROC histogram bins in EvalResult */
+#define TANN_MAX_CLASSES 16
+#define TANN_ROC_BINS 256
+
+
+/* Heap allocator used by the library, free gets the size that was allocated */
+typedef struct tann_allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+    size_t alignment; /* power of two the blocks of alloc are aligned to and tann_alloc keeps, 0 means 16 */
+} tann_allocator;
+
+
+/* Counting allocator on top of another one, see tann_alloc_counter_start */
+typedef struct tann_alloc_counter {
+    tann_allocator allocator; /* the counting allocator itself */
+    const tann_allocator *parent;
+    long allocs, frees;
+    long total_bytes, live_bytes, peak_bytes;
+} tann_alloc_counter;
+
+
+/* Aborts if stmt made a heap allocation through the library while counter was installed.
+ * The counter is process wide, so other threads must not allocate meanwhile. */
+#define TANN_ASSERT_NO_ALLOC(counter, stmt) \
+    do { \
+        long tann_allocs_before_ = __atomic_load_n(&(counter)->allocs, __ATOMIC_SEQ_CST); \
+        stmt; \
+        long tann_allocs_made_ = __atomic_load_n(&(counter)->allocs, __ATOMIC_SEQ_CST) - tann_allocs_before_; \
+        if (tann_allocs_made_ != 0) { \
+            fprintf(stderr, "%s:%d: %ld heap allocations in %s\n", __FILE__, __LINE__, tann_allocs_made_, #stmt); \
+            abort(); \
+        } \
+    } while (0)
+
+
+/* State of a xoshiro128** random number generator */
+typedef struct tann_rng {
+    uint32_t s[4];
+} tann_rng;
 
 
 /* Structure to store dimensions for datasets, matrices, etc... */
@@ -36,11 +110,98 @@ typedef struct Dim {
 } Dim;
 
 
+/* Dataset with contiguous rows of dim.w features followed by the label,
+ * X and y are row views into data so they work with every float ** function */
+typedef struct Dataset {
+    Dim dim;
+    float *data;
+    float **X;
+    float **y;
+} Dataset;
+
+
+/* Synthetic datasets of the bulk generators */
+typedef enum DatasetKind {
+    DATA_CLUSTERS,
+    DATA_CIRCLES,
+    DATA_SPIRAL,
+    DATA_CHESSTABLE
+} DatasetKind;
+
+
+/* Column operations of a feature pipeline */
+typedef enum FeatureOpKind {
+    FEAT_BIAS, /* scale */
+    FEAT_COPY, /* x[a] * scale */
+    FEAT_SIN, /* sin(x[a] * scale) */
+    FEAT_MUL, /* x[a] * x[b] * scale */
+    FEAT_SQUARE /* x[a] * x[a] * scale */
+} FeatureOpKind;
+
+
+/* A single output column of a feature pipeline */
+typedef struct FeatureOp {
+    FeatureOpKind kind;
+    int a, b; /* input columns */
+    float scale;
+} FeatureOp;
+
+
+/* Feature transform applied to whole batches, output column i comes from ops[i] */
+typedef struct FeaturePipeline {
+    int in_w; /* number of input columns used */
+    int n_ops; /* number of output columns */
+    FeatureOp *ops;
+} FeaturePipeline;
+
+
+/* Compressed sparse row matrix for wide, mostly zero samples */
+typedef struct SparseMatrix {
+    Dim dim;
+    int nnz; /* number of stored elements */
+    int *row_ptr; /* the elements of row i are at row_ptr[i] .. row_ptr[i + 1] - 1 */
+    int *col; /* column index of every element */
+    float *val;
+} SparseMatrix;
+
+
+/* Activation function of a layer */
+typedef enum Activation {
+    ACT_SIGMOID,
+    ACT_SOFTMAX,
+    ACT_RELU,
+    ACT_LEAKY_RELU,
+    ACT_TANH,
+    ACT_LINEAR
+} Activation;
+
+
+/* How the processes of train_net_distributed exchange their gradients */
+typedef enum DistTransport {
+    DIST_SHM, /* shared memory segment and a process-shared barrier */
+    DIST_SOCKET /* Unix domain sockets between ring neighbours */
+} DistTransport;
+
+
+/* Hot-swappable model shared by inference threads, defined in perceptron_handle.c */
+typedef struct ModelHandle ModelHandle;
+
+
+/* Decision surface cache of the plotter, defined in perceptron_plotter.c */
+typedef struct PlotCache PlotCache;
+
+
+/* Persistent work-stealing thread pool, defined in perceptron_pool.c */
+typedef struct ThreadPool ThreadPool;
+
+
 /* Structure for a layer */
 typedef struct Layer {
     Dim dim;
+    Activation act;
     float *in;
     float *out;
+    float *delta;
     float **weights;
     struct Layer *next, *prev;
 } Layer;
@@ -49,16 +210,212 @@ typedef struct Layer {
 /* Doubly linked list for a neural network */
 typedef struct NeuralNet {
     Layer *input, *output;
+    unsigned long version; /* unique stamp of the weights, renewed by net_changed */
+    long n_seen; /* samples learned by partial_fit */
+    float running_loss; /* moving average of the partial_fit loss, see TANN_LOSS_DECAY */
 } NeuralNet;
 
 
+/* Hardware counters of the instrumentation layer, in the order of their values */
+typedef enum tann_perf_event {
+    TANN_PERF_CYCLES,
+    TANN_PERF_INSTRUCTIONS,
+    TANN_PERF_L1D_MISSES,
+    TANN_PERF_LLC_MISSES,
+    TANN_PERF_BRANCH_MISSES
+} tann_perf_event;
+
+
+/* Counters opened on a thread, fd is -1 for the unavailable ones */
+typedef struct tann_perf {
+    int fd[TANN_PERF_EVENTS];
+    int n_open;
+} tann_perf;
+
+
+/* Timing counters of a single layer */
+typedef struct tann_layer_stats {
+    double forward_sec;
+    double backward_sec;
+    long forward_calls;
+    long backward_calls;
+    long long forward_events[TANN_PERF_EVENTS]; /* hardware counters, see tann_stats_enable_perf */
+    long long backward_events[TANN_PERF_EVENTS];
+} tann_layer_stats;
+
+
+/* Instrumentation results collected by feed_forward_net and train_net */
+typedef struct tann_stats {
+    int n_layers;
+    tann_layer_stats layer[TANN_MAX_LAYERS];
+    long samples; /* training samples processed */
+    long epochs;
+    double train_sec; /* wall time spent in train_net */
+    double last_epoch_sec;
+    long allocs; /* heap allocations made by the library */
+    long alloc_bytes;
+    int perf_events; /* hardware counters collected, 0 if they are unavailable */
+} tann_stats;
+
+
+/* Metrics of a network evaluated on a dataset */
+typedef struct EvalResult {
+    int n; /* number of evaluated samples */
+    int correct;
+    float accuracy;
+    float rmse;
+    float mae;
+    int n_classes;
+    long confusion[TANN_MAX_CLASSES][TANN_MAX_CLASSES]; /* [true class][predicted class] */
+    long roc_pos[TANN_ROC_BINS]; /* score histogram of the positive samples */
+    long roc_neg[TANN_ROC_BINS]; /* score histogram of the negative samples */
+    float auc; /* area under the ROC curve, class 1 is the positive class */
+} EvalResult;
+
+
+/* Layer in blocked sparse format: the non-zero blocks of TANN_PRUNE_BLOCK outputs of every weight row */
+typedef struct SparseLayer {
+    Dim dim;
+    Activation act;
+    int n_blocks;
+    int *row_ptr; /* the blocks of weight row i are at row_ptr[i] .. row_ptr[i + 1] - 1 */
+    int *block_col; /* first output of every block */
+    float *val; /* TANN_PRUNE_BLOCK weights per block */
+} SparseLayer;
+
+
+/* Pruned neural net for sparse inference */
+typedef struct SparseNet {
+    int n_layers;
+    int max_width; /* size of the buffers needed by sparse_net_forward */
+    SparseLayer *layers;
+} SparseNet;
+
+
+/* Metrics of a k-fold cross-validation, averaged over the folds */
+typedef struct CVResult {
+    int k;
+    float accuracy, accuracy_std;
+    float rmse, mae, auc;
+    double train_sec; /* wall time of the whole run */
+} CVResult;
+
+
+/* Buffer sizes and memory footprint of infer_static */
+typedef struct InferencePlan {
+    int n_layers;
+    int in_w, out_w;
+    int buf_a, buf_b; /* floats needed in the two ping-pong buffers */
+    size_t static_bytes; /* activation memory of infer_static */
+    size_t layer_bytes; /* in, out and delta arrays kept by the layers */
+} InferencePlan;
+
+
+/* Static cost of a layer per sample, computed from its dimensions by net_cost */
+typedef struct LayerCost {
+    Dim dim;
+    Activation act;
+    long params;
+    size_t param_bytes;
+    double forward_flops, backward_flops; /* a multiply-add is two FLOPs */
+    size_t act_bytes; /* in, out and delta arrays kept by the layer */
+    float intensity; /* forward FLOPs per byte of weights, inputs and outputs */
+} LayerCost;
+
+
+/* Cost model of a whole net */
+typedef struct NetCost {
+    int n_layers;
+    LayerCost layer[TANN_MAX_LAYERS];
+    LayerCost total; /* dim is the input and output width of the net */
+} NetCost;
+
+
+/* Outcome of prune_and_finetune */
+typedef struct PruneReport {
+    float sparsity; /* fraction of zero weights */
+    float block_sparsity; /* fraction of weight blocks skipped by the sparse kernel */
+    float dense_accuracy; /* on the held-out set */
+    float pruned_accuracy;
+} PruneReport;
+
+
+/* Integer format of the weights of a quantized net, the activations are 16 bit in both */
+typedef enum QFormat {
+    Q15, /* 16 bit weights, can be trained on the device */
+    Q7 /* 8 bit weights, inference only */
+} QFormat;
+
+
+/* Layer of a quantized net, a value v with f fractional bits stands for v / 2^f */
+typedef struct QLayer {
+    Dim dim;
+    Activation act;
+    int w_frac, out_frac; /* fractional bits of the weights and of the outputs */
+    int16_t *w; /* [dim.h][dim.w] row-major, NULL in Q7 */
+    int8_t *w8; /* same in Q7, NULL in Q15 */
+    int16_t *out;
+    int16_t *delta; /* 12 fractional bits, like the training targets */
+    int32_t *acc; /* weighted inputs */
+} QLayer;
+
+
+/* Fixed-point copy of a net made by quantize_net */
+typedef struct QNet {
+    QFormat fmt;
+    int n_layers;
+    int in_frac; /* fractional bits of the inputs */
+    QLayer *layers;
+} QNet;
+
+
+/* Outcome of qnet_validate */
+typedef struct QNetReport {
+    float float_accuracy;
+    float fixed_accuracy;
+    float agreement; /* fraction of samples where both nets predict the same class */
+    float max_abs_err; /* largest difference between the float and the fixed-point outputs */
+} QNetReport;
+
+
+/* Background writer of training checkpoints, defined in perceptron_checkpoint.c */
+typedef struct Checkpoint Checkpoint;
+
+
+/* K same-shaped two layer nets interleaved model by model (struct of arrays) */
+typedef struct Ensemble {
+    int k; /* number of models */
+    int n_in;
+    int n_hidden; /* largest hidden layer, smaller ones are masked */
+    int *hidden_sizes;
+    float *w1; /* [n_in][n_hidden][k] */
+    float *w2; /* [n_hidden][k] */
+    float *mask; /* [n_hidden][k] */
+    float *hidden, *delta_hidden; /* [n_hidden][k] */
+    float *out, *delta_out; /* [k] */
+} Ensemble;
+
+
+#ifndef TANN_NO_SDL
 SDL_Event ev;
+#endif
+
+/* Sigmoid activation function, inline so the loops calling it vectorize */
+static inline float sigmoid(float x) {
+    return 1.0f / (1.0f + expf(-(x - 0.5f)));
+}
 
 /* Functions in perceptron.c */
 void end(); /* Terminates program */
 float dist(float ax, float ay, float bx, float by); /* Returns the distance between two points */
-float sigmoid(float x); /* Sigmoid activation function */
 float sigmoid_der(float x); /* Derivative of sigmoid */
+void softmax(const float *z, float *p, int n); /* Numerically stable softmax */
+void activate(Activation act, const float *in, float *out, int n); /* Applies an activation function */
+/* Multiplies backpropagated errors by the derivative of the activation, computed from its outputs */
+void activation_delta(Activation act, const float *out, float *delta, int n);
+const char *activation_name(Activation act); /* Name of an activation function */
+/* Fused softmax and cross-entropy, writes the probabilities and the delta, returns the loss or -1 for a bad label */
+float softmax_cross_entropy(const float *z, float *p, float *delta, int n, int label);
 float sum(const float *v, int n); /* Sum of the elements of an array */
 float dot_product(float *v, float *u, int n); /* Dot product of two arrays */
 float rand_float(); /* Returns arandom float between 0 and 1 */
@@ -82,11 +439,15 @@ void create_chesstable(float **X, float **y, int n, float dist); /* Creates a ch
 void split_train_test(float **X, float **y, float **X_train, float **X_test, float **y_train,
                       float **y_test, Dim dim, float ratio);
 float *get_row(float **v, int h, int idx);
+SparseMatrix *create_csr(Dim dim, int nnz); /* Allocates an empty CSR matrix */
+SparseMatrix *dense_to_csr(float **X, Dim dim); /* Converts a dense matrix into CSR format */
+void free_csr(SparseMatrix *m); /* Free function for a CSR matrix */
 
 
 /* Functions in perceptron_plotter.c
  * Remove these if you don't want to use SDL
  * */
+#ifndef TANN_NO_SDL
 Uint32 timer(Uint32 ms, void *param); /* Timer for SDL */
 void plot_init(SDL_Window **pwindow, SDL_Renderer **prenderer); /* Initialize SDL */
 void plot_error_scaled(struct SDL_Renderer *renderer, float *J, int step, Uint32 color);
@@ -94,16 +455,231 @@ void plot_accuracy_scaled(struct SDL_Renderer *renderer, float *acc, int step, U
 /* Uses SDL2 to visualize a 2D dataset */
 void plot_clusters(struct SDL_Renderer *renderer, float **X, float **y, int output_dim);
 void plot_trained_net(struct SDL_Renderer *renderer, NeuralNet *ann); /* Visualises trained net */
+PlotCache *create_plot_cache(); /* Cache of the decision surface for repeated plots */
+void free_plot_cache(PlotCache *cache);
+/* Same as plot_trained_net, only recomputes the surface if the net changed since the last plot */
+void plot_trained_net_cached(struct SDL_Renderer *renderer, NeuralNet *ann, PlotCache *cache);
+int plot_cache_last_evals(PlotCache *cache); /* Net evaluations of the last plot, 0 if it was reused */
+#endif
+
+
+/* Functions in perceptron_dist.c */
+/* Data-parallel training on n_workers processes with a ring all-reduce of the gradients */
+int train_net_distributed(NeuralNet *ann, float **X, float **y, Dim dim, int n_epoch, int n_workers,
+                          int batch, DistTransport transport, float *J, float *acc);
+
+
+/* Functions in perceptron_handle.c */
+ModelHandle *create_model_handle(NeuralNet *ann); /* Creates a handle that owns ann */
+void free_model_handle(ModelHandle *h); /* Frees the handle and its current net */
+int model_reader_register(ModelHandle *h); /* Reader slot of the calling thread, -1 if none is left */
+void model_reader_unregister(ModelHandle *h, int reader);
+NeuralNet *model_read_begin(ModelHandle *h, int reader); /* Current net, lock-free */
+void model_read_end(ModelHandle *h, int reader); /* Releases the net of model_read_begin */
+void model_publish(ModelHandle *h, NeuralNet *ann); /* Swaps in ann, frees the old net after its readers */
+
+
+/* Functions in perceptron_alloc.c */
+void tann_set_allocator(const tann_allocator *allocator); /* Allocator of later allocations, NULL restores malloc */
+const tann_allocator *tann_get_allocator(); /* Allocator of new allocations */
+void *tann_alloc(size_t size); /* Allocates through the installed allocator */
+void *tann_calloc(size_t n, size_t size); /* Allocates n zeroed elements */
+void tann_free(void *ptr); /* Returns a block to the allocator that made it */
+void tann_alloc_counter_start(tann_alloc_counter *counter); /* Installs a counting allocator on top of the current one */
+void tann_alloc_counter_stop(tann_alloc_counter *counter); /* Reinstalls the allocator below the counter */
+void tann_alloc_counter_print(FILE *file, const tann_alloc_counter *counter); /* Prints the counts */
+
+
+/* Functions in perceptron_random.c */
+void tann_rng_seed(tann_rng *rng, uint64_t seed, uint64_t stream); /* Seeds an independent stream */
+uint32_t tann_rng_next(tann_rng *rng); /* Next 32 random bits */
+float tann_rng_float(tann_rng *rng); /* Random float in [0, 1) */
+void tann_rng_fill(tann_rng *rng, float *v, int n); /* Fills an array with random floats in [0, 1) */
+void tann_seed(uint64_t seed); /* Seeds the library before any worker starts, replaces srand() */
+void tann_seed_thread(uint32_t worker); /* Gives a worker thread the stream of its index */
+tann_rng *tann_thread_rng(); /* Default generator of the calling thread */
+uint32_t tann_rand(); /* Next 32 random bits of the calling thread, replaces rand() */
+
+
+/* Functions in perceptron_datagen.c */
+int dataset_width(DatasetKind kind); /* Number of features of a generated dataset */
+Dataset *create_dataset(long n, int w); /* Allocates n rows of w features and a label, NULL if n > INT_MAX */
+void free_dataset(Dataset *ds); /* Free allocated memory */
+/* Generates n labeled samples on n_threads threads, the result only depends on the seed */
+Dataset *generate_dataset(DatasetKind kind, long n, uint64_t seed, int n_threads);
+/* Streams a generated dataset into a binary file, returns 0 on success */
+int generate_dataset_file(const char *path, DatasetKind kind, long n, uint64_t seed, int n_threads);
+Dataset *load_dataset_file(const char *path); /* Loads a dataset file, returns NULL on error */
+
+
+/* Functions in perceptron_features.c */
+FeaturePipeline *create_feature_pipeline(const FeatureOp *ops, int n_ops); /* Creates a pipeline */
+void free_feature_pipeline(FeaturePipeline *fp); /* Free allocated memory */
+FeaturePipeline *spiral_features(); /* [1, x, y] -> the 8 features of the spiral example */
+/* Transforms n rows in tiles, in and out may be the same rows */
+void feature_pipeline_apply(const FeaturePipeline *fp, float **in, float **out, int n);
+
+
+/* Functions in perceptron_stats.c */
+double wall_time(); /* Monotonic wall clock time in seconds */
+void tann_stats_reset(tann_stats *stats); /* Clears every counter */
+void tann_stats_attach(tann_stats *stats); /* Starts collecting on the calling thread, NULL detaches */
+tann_stats *tann_stats_active(); /* Stats attached to the calling thread or NULL */
+void tann_stats_count_alloc(size_t bytes); /* Records a heap allocation */
+int tann_stats_enable_perf(tann_stats *stats); /* Opens the hardware counters of the thread, returns how many work */
+void tann_stats_disable_perf(); /* Closes the hardware counters of the calling thread */
+double tann_stats_clock(tann_stats *stats); /* wall_time() that also starts a hardware counter interval */
+void tann_stats_add_forward(tann_stats *stats, int layer, double sec);
+void tann_stats_add_backward(tann_stats *stats, int layer, double sec);
+void tann_stats_print(FILE *file, const tann_stats *stats); /* Dumps the counters as text */
+void tann_stats_print_json(FILE *file, const tann_stats *stats); /* Dumps the counters as JSON */
+/* Per layer IPC, cache misses per 1000 instructions and DRAM bytes per FLOP of the layers of ann */
+void tann_stats_print_perf(FILE *file, const tann_stats *stats, NeuralNet *ann);
+
+
+/* Functions in perceptron_perf.c */
+int tann_perf_open(tann_perf *perf); /* Opens the counters on the calling thread, returns how many work */
+void tann_perf_read(const tann_perf *perf, long long *values); /* Current counts, -1 if unavailable */
+void tann_perf_close(tann_perf *perf); /* Closes the counters */
+const char *tann_perf_event_name(int event); /* Name of a tann_perf_event */
+
+
+/* Functions in perceptron_compiler.c */
+/* Generates a standalone C inference function called <name>_predict from a trained net */
+void compile_net(NeuralNet *ann, FILE *file, const char *name);
+
+
+/* Functions in perceptron_eval.c */
+/* Evaluates a network on n_threads threads in a single pass */
+void eval_net(NeuralNet *ann, float **X, float **y, Dim dim, int n_threads, EvalResult *res);
+
+
+/* Functions in perceptron_cv.c */
+/* k-fold cross-validation over index views, the folds are trained concurrently on copies of proto */
+void cross_validate(int k, NeuralNet *proto, float **X, float **y, Dim dim, int n_epoch,
+                    int n_threads, CVResult *res, EvalResult *folds);
+void print_cv_result(FILE *file, const CVResult *res); /* Prints the aggregated metrics */
+
+
+/* Functions in perceptron_ensemble.c */
+/* Creates K two layer nets with one output each (out must be {in.w, 1}), returns NULL otherwise */
+Ensemble *create_ensemble(Dim in, Dim out, int k, const int *hidden_sizes, const unsigned int *seeds);
+void free_ensemble(Ensemble *ens); /* Free allocated memory */
+void feed_forward_ensemble(Ensemble *ens, const float *X); /* Feeds forward one sample through every model */
+/* Trains every model at once, J and acc are k x n_epoch matrices or NULL */
+void train_ensemble(Ensemble *ens, float **X, float **y, Dim dim, int n_epoch, float **J, float **acc);
+NeuralNet *ensemble_get_net(Ensemble *ens, int m); /* Copies one model into a standalone net */
+/* Evaluates every model, res has one entry per model */
+void test_ensemble(Ensemble *ens, float **X, float **y, Dim dim, int n_threads, EvalResult *res);
+
+
+/* Functions in perceptron_checkpoint.c */
+int save_net(NeuralNet *ann, FILE *file); /* Saves a net into a binary file, returns 0 on success */
+NeuralNet *load_net(FILE *file); /* Loads a net saved by save_net, returns NULL on error */
+int save_feature_pipeline(const FeaturePipeline *fp, FILE *file); /* Saves a pipeline, usually after its net */
+FeaturePipeline *load_feature_pipeline(FILE *file); /* Loads a saved pipeline, returns NULL on error */
+/* Checkpoints into path every every_epochs epochs or every_sec seconds, 0 disables either */
+Checkpoint *checkpoint_open(const char *path, int every_epochs, float every_sec);
+/* Snapshots the net and the history after epoch epochs if due, the file is written in the background */
+void checkpoint_step(Checkpoint *ckpt, NeuralNet *ann, float *J, float *acc, int epoch, int force);
+int checkpoint_close(Checkpoint *ckpt); /* Flushes and stops the writer, returns 0 if every write succeeded */
+/* Loads a checkpoint into a new net, J, acc (capacity floats each) and the number of finished epochs */
+NeuralNet *resume_net(const char *path, float *J, float *acc, int capacity, int *epoch);
+
+
+/* Functions in perceptron_prune.c */
+float prune_net(NeuralNet *ann, float sparsity); /* Zeroes the smallest weights of every layer */
+float net_sparsity(NeuralNet *ann); /* Fraction of zero weights */
+/* Prunes in rounds with fine-tuning epochs in between, reports dense vs pruned accuracy on X_test */
+void prune_and_finetune(NeuralNet *ann, float **X, float **y, Dim dim, float **X_test, float **y_test,
+                        Dim test_dim, float sparsity, int n_rounds, int n_epoch, PruneReport *report);
+SparseNet *sparse_net_from(NeuralNet *ann); /* Converts a pruned net into blocked sparse format */
+void free_sparse_net(SparseNet *net); /* Free allocated memory */
+float sparse_net_block_sparsity(SparseNet *net); /* Fraction of skipped weight blocks */
+/* Sparse inference of one sample with two max_width buffers, returns the output */
+float *sparse_net_forward(SparseNet *net, const float *x, float *buf_a, float *buf_b);
+void sparse_net_forward_batch(SparseNet *net, float **X, int n, float **out); /* Sparse inference of n samples */
+float sparse_net_accuracy(SparseNet *net, float **X, float **y, Dim dim); /* Accuracy of a sparse net */
+
+
+/* Functions in perceptron_plan.c */
+void plan_inference(NeuralNet *ann, InferencePlan *plan); /* Peak activation footprint of a net */
+void print_inference_plan(FILE *file, const InferencePlan *plan); /* Prints the memory report of a plan */
+/* Heap free inference with two caller buffers, returns the output */
+const float *infer_static(NeuralNet *ann, const float *x, float *buf_a, float *buf_b);
+
+
+/* Functions in perceptron_fixed.c */
+/* Fixed-point copy of a trained net, X holds n calibration samples or NULL */
+QNet *quantize_net(NeuralNet *ann, QFormat fmt, float **X, int n);
+void free_qnet(QNet *q);
+void qnet_quantize_input(const QNet *q, const float *x, int16_t *qx); /* Converts a float sample to the input format */
+const int16_t *qnet_forward(QNet *q, const int16_t *x); /* Integer-only feed forward, returns the outputs */
+void qnet_output(const QNet *q, float *out); /* Outputs of the last qnet_forward as floats */
+int qnet_predict_class(const QNet *q); /* Class predicted by the last qnet_forward */
+int qnet_quantize_target(const QNet *q, const float *y, int16_t *qy); /* Training target of a label, -1 if invalid */
+int qnet_train_sample(QNet *q, const int16_t *x, const int16_t *y); /* Integer-only gradient step, -1 for Q7 */
+/* Accuracy of both nets and their agreement on a labelled dataset */
+void qnet_validate(QNet *q, NeuralNet *ann, float **X, float **y, Dim dim, QNetReport *rep);
+
+
+/* Functions in perceptron_cost.c */
+void net_cost(NeuralNet *ann, NetCost *cost); /* Parameters, FLOPs and memory of every layer */
+double cost_latency_ns(const LayerCost *c, double gflops, int train); /* Estimated ns per sample at gflops */
+/* Prints the cost table, with latency estimates if the GFLOP/s of the machine are not 0 */
+void print_net_cost(FILE *file, const NetCost *cost, double forward_gflops, double train_gflops);
+void print_net_cost_json(FILE *file, const NetCost *cost, double forward_gflops, double train_gflops);
+void calibrate_throughput(double *forward_gflops, double *train_gflops); /* GFLOP/s of a reference net */
+
+
+/* Functions in perceptron_pool.c */
+ThreadPool *create_thread_pool(int n_threads); /* Starts n_threads - 1 workers, the caller is the last one */
+void free_thread_pool(ThreadPool *pool); /* Stops the workers and frees the pool */
+int thread_pool_size(ThreadPool *pool); /* Threads working on a job, the caller included */
+/* Runs fn(arg, task) for every task in [0, n_tasks), returns -1 if the pool is busy */
+int thread_pool_run(ThreadPool *pool, int n_tasks, void (*fn)(void *arg, int task), void *arg);
+void tann_set_thread_pool(ThreadPool *pool); /* feed_forward_net splits wide layers on pool, NULL disables */
+ThreadPool *tann_thread_pool(); /* Pool used by feed_forward_net or NULL */
 
 
 /* Functions in perceptron_libs.c */
 NeuralNet *create_net(Dim in, Dim out); /* Creates a neural net with one hidden layer */
+NeuralNet *create_softmax_net(Dim in, Dim out); /* Same as create_net with a softmax output layer */
+/* Same as create_net with the activations of the hidden and the output neurons */
+NeuralNet *create_net_act(Dim in, Dim out, Activation hidden, Activation output);
 void add_hidden_layer(NeuralNet *ann, int layer_size); /* Inserts a hidden layer between the input and the second layer */
+/* Same as add_hidden_layer, act is the activation of the new neurons */
+void add_hidden_layer_act(NeuralNet *ann, int layer_size, Activation act);
 void print_net(NeuralNet *ann); /* Prints the weight matrices */
 void free_net(NeuralNet *ann); /* Free allocated memory */
+NeuralNet *copy_net(NeuralNet *ann); /* Creates a deep copy of a neural net, it keeps the version */
+void net_changed(NeuralNet *ann); /* Gives the net a new version, call it after editing the weights */
 void feed_forward_net(NeuralNet *ann, float *X); /* Feeds forward information  */
+void feed_forward_sparse(NeuralNet *ann, SparseMatrix *X, int row); /* Feeds forward a CSR encoded sample */
+/* Feeds forward n samples into out (n x output width), leaves the layer buffers untouched */
+void feed_forward_batch(NeuralNet *ann, float **X, int n, float **out);
+/* Same with caller buffers of n * plan.buf_a and n * plan.buf_b floats, never allocates */
+void feed_forward_batch_static(NeuralNet *ann, float **X, int n, float **out, float *buf_a, float *buf_b);
+int predict_class(NeuralNet *ann); /* Class predicted by the last feed forward */
+int predict_class_from(NeuralNet *ann, const float *out); /* Class predicted from an output of the net */
+int net_param_count(NeuralNet *ann); /* Number of weights, the length of a flattened gradient */
+/* Adds the gradient step of the last fed forward sample to grad, returns the loss or -1 for a bad label */
+float accumulate_gradient(NeuralNet *ann, float *X, float *y, float *grad);
+void apply_gradient(NeuralNet *ann, const float *grad, float scale); /* Adds scale * grad to the weights */
+/* Learns n new samples with one gradient step each, returns their mean loss */
+float partial_fit(NeuralNet *ann, float **X, float **y, int n);
+/* Trains one epoch keeping the weights with a zero mask at zero, without a new version */
+void train_epoch_masked(NeuralNet *ann, float **X, float **y, Dim dim, float ***mask);
+/* Trains network for one epoch */
+void train_epoch(NeuralNet *ann, float **X, float **y, Dim dim, float *J, float *acc);
 /* Trains network */
 void train_net(NeuralNet *ann, float **X, float **y, float *J, float* acc, Dim dim, int n_epoch);
+/* Trains network on CSR encoded samples, only the non-zero features touch the first layer */
+void train_epoch_sparse(NeuralNet *ann, SparseMatrix *X, float **y, float *J, float *acc);
+void train_net_sparse(NeuralNet *ann, SparseMatrix *X, float **y, float *J, float *acc, int n_epoch);
+/* Trains network from start_epoch, taking snapshots into ckpt (may be NULL) */
+void train_net_from(NeuralNet *ann, float **X, float **y, float *J, float *acc, Dim dim,
+                    int start_epoch, int n_epoch, Checkpoint *ckpt);
 /* Validates network */
 void test_net(NeuralNet *ann, float **X, float **y, Dim dim);
 
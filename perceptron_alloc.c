@@ -0,0 +1,153 @@
+/*
+ * This file contains the allocator hooks of the library. Every heap
+ * allocation of the library goes through tann_alloc, which calls the
+ * allocator installed with tann_set_allocator (malloc by default), so
+ * arenas, hugepage backed or NUMA local allocators can be plugged in.
+ * Each block starts with a small header that remembers its allocator and
+ * its size: a block is always returned to the allocator that made it,
+ * even if another one was installed in the meantime. The header is padded
+ * to the alignment of the allocator, so a 64 byte or page aligned
+ * allocator still hands out 64 byte or page aligned blocks.
+ *
+ * The counting allocator wraps another allocator and counts the calls,
+ * the live and the peak bytes. With TANN_ASSERT_NO_ALLOC it can check
+ * that a steady-state training step or inference call never touches
+ * the heap.
+ *
+ */
+
+#include "perceptron.h"
+
+/* Smallest header, keeps the blocks aligned to 16 bytes like malloc does */
+#define ALLOC_HEADER 16
+
+
+typedef struct AllocHeader {
+    const tann_allocator *allocator;
+    size_t size;
+} AllocHeader;
+
+
+static void *default_alloc(void *ctx, size_t size) {
+    (void) ctx;
+    return malloc(size);
+}
+
+
+static void default_free(void *ctx, void *ptr, size_t size) {
+    (void) ctx;
+    (void) size;
+    free(ptr);
+}
+
+
+static const tann_allocator default_allocator = {default_alloc, default_free, NULL, 0};
+static const tann_allocator *current_allocator = &default_allocator;
+
+
+/* Installs the allocator used by every later allocation, NULL restores malloc.
+ * The allocator must stay valid until all of its blocks are freed. */
+void tann_set_allocator(const tann_allocator *allocator) {
+    __atomic_store_n(&current_allocator, allocator != NULL ? allocator : &default_allocator, __ATOMIC_RELEASE);
+}
+
+
+/* Allocator used by new allocations */
+const tann_allocator *tann_get_allocator() {
+    return __atomic_load_n(&current_allocator, __ATOMIC_ACQUIRE);
+}
+
+
+/* Bytes in front of a block of allocator, a multiple of its alignment */
+static size_t header_size(const tann_allocator *allocator) {
+    return allocator->alignment > ALLOC_HEADER ? allocator->alignment : ALLOC_HEADER;
+}
+
+
+/* Allocates size bytes with the installed allocator, returns NULL on failure */
+void *tann_alloc(size_t size) {
+    const tann_allocator *allocator = tann_get_allocator();
+    size_t pad = header_size(allocator);
+    unsigned char *block = (unsigned char*) allocator->alloc(allocator->ctx, size + pad);
+    if (block == NULL)
+        return NULL;
+
+    /* The header sits right in front of the returned pointer, the padding before it is unused */
+    AllocHeader *header = (AllocHeader*) (block + pad - sizeof(AllocHeader));
+    header->allocator = allocator;
+    header->size = size;
+    tann_stats_count_alloc(size);
+    return block + pad;
+}
+
+
+/* Allocates n zeroed elements of size bytes */
+void *tann_calloc(size_t n, size_t size) {
+    void *ptr = tann_alloc(n * size);
+    if (ptr != NULL)
+        memset(ptr, 0, n * size);
+    return ptr;
+}
+
+
+/* Returns a block to the allocator that made it, NULL is ignored */
+void tann_free(void *ptr) {
+    if (ptr == NULL)
+        return;
+    AllocHeader *header = (AllocHeader*) ((unsigned char*) ptr - sizeof(AllocHeader));
+    const tann_allocator *allocator = header->allocator;
+    size_t pad = header_size(allocator);
+    allocator->free(allocator->ctx, (unsigned char*) ptr - pad, header->size + pad);
+}
+
+
+static void *counting_alloc(void *ctx, size_t size) {
+    tann_alloc_counter *c = (tann_alloc_counter*) ctx;
+    void *ptr = c->parent->alloc(c->parent->ctx, size);
+    if (ptr == NULL)
+        return NULL;
+
+    long live = __atomic_add_fetch(&c->live_bytes, (long) size, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&c->peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&c->peak_bytes, &peak, live, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->total_bytes, (long) size, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+    tann_alloc_counter *c = (tann_alloc_counter*) ctx;
+    __atomic_add_fetch(&c->frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->live_bytes, (long) size, __ATOMIC_RELAXED);
+    c->parent->free(c->parent->ctx, ptr, size);
+}
+
+
+/* Creates a counting allocator on top of the installed one and installs it.
+ * The byte counts include the block headers. */
+void tann_alloc_counter_start(tann_alloc_counter *counter) {
+    memset(counter, 0, sizeof(tann_alloc_counter));
+    counter->parent = tann_get_allocator();
+    counter->allocator.alloc = counting_alloc;
+    counter->allocator.free = counting_free;
+    counter->allocator.ctx = counter;
+    counter->allocator.alignment = counter->parent->alignment;
+    tann_set_allocator(&counter->allocator);
+}
+
+
+/* Puts back the allocator that was installed before the counter. The counter
+ * must outlive the blocks it made, they are still returned through it. */
+void tann_alloc_counter_stop(tann_alloc_counter *counter) {
+    tann_set_allocator(counter->parent);
+}
+
+
+/* Prints the counts */
+void tann_alloc_counter_print(FILE *file, const tann_alloc_counter *counter) {
+    fprintf(file, "Allocations: %ld   Frees: %ld   Allocated: %ld bytes   Live: %ld bytes   Peak: %ld bytes\n",
+            counter->allocs, counter->frees, counter->total_bytes, counter->live_bytes, counter->peak_bytes);
+}
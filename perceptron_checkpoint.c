@@ -0,0 +1,371 @@
+/*
+ * This file contains model persistence and resumable training. A net
+ * can be saved to and loaded from a binary file. During training a
+ * Checkpoint copies the weights, the epoch counter and the error and
+ * accuracy history into a snapshot buffer every few epochs or seconds,
+ * and a background thread writes the snapshot to a temporary file which
+ * is then atomically renamed over the previous checkpoint. Training
+ * never waits for the disk and a killed process always leaves a complete
+ * checkpoint behind.
+ *
+ * Note: the files use the byte order of the machine that wrote them.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include "perceptron.h"
+
+#define NET_MAGIC 0x4E4E4154 /* "TANN" */
+#define CHECKPOINT_MAGIC 0x504B4354 /* "TCKP" */
+#define PIPELINE_MAGIC 0x4C504654 /* "TFPL" */
+#define PIPELINE_MAX_COLUMNS 65536 /* bound on the columns of a loaded pipeline */
+#define FILE_VERSION 1
+
+
+/* Growable byte buffer for the snapshots */
+typedef struct Buffer {
+    unsigned char *data;
+    size_t len, cap;
+} Buffer;
+
+
+/* Background checkpoint writer */
+struct Checkpoint {
+    char *path;
+    char *tmp_path;
+    int every_epochs;
+    double every_sec;
+    double last_time;
+    int last_epoch;
+
+    Buffer fill; /* filled by the training thread */
+    Buffer pending; /* waiting to be written */
+    Buffer writing; /* being written by the writer thread */
+    int has_pending;
+    int stop;
+    int failed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+
+static void buffer_put(Buffer *buf, const void *src, size_t n) {
+    if (buf->len + n > buf->cap) {
+        size_t cap = buf->cap > 0 ? buf->cap : 256;
+        while (buf->len + n > cap)
+            cap *= 2;
+        /* The allocator hooks have no realloc, so the buffer grows by copying */
+        unsigned char *data = (unsigned char*) tann_alloc(cap);
+        if (buf->len > 0)
+            memcpy(data, buf->data, buf->len);
+        tann_free(buf->data);
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, src, n);
+    buf->len += n;
+}
+
+
+static void buffer_put_int(Buffer *buf, int32_t v) {
+    buffer_put(buf, &v, sizeof(v));
+}
+
+
+/* Appends the layers and weights of a net to a buffer */
+static void serialize_net(Buffer *buf, NeuralNet *ann) {
+    int32_t n_layers = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+        ++n_layers;
+
+    buffer_put_int(buf, NET_MAGIC);
+    buffer_put_int(buf, FILE_VERSION);
+    buffer_put_int(buf, n_layers);
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        buffer_put_int(buf, iter->dim.h);
+        buffer_put_int(buf, iter->dim.w);
+        buffer_put_int(buf, iter->act);
+    }
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+        for (int i = 0; i < iter->dim.h; ++i)
+            buffer_put(buf, iter->weights[i], sizeof(float) * iter->dim.w);
+}
+
+
+static int read_int(FILE *file, int32_t *v) {
+    return fread(v, sizeof(int32_t), 1, file) == 1 ? 0 : -1;
+}
+
+
+/* Reads a net written by serialize_net, returns NULL on a bad file */
+static NeuralNet *deserialize_net(FILE *file) {
+    int32_t magic, version, n_layers;
+    if (read_int(file, &magic) || read_int(file, &version) || read_int(file, &n_layers))
+        return NULL;
+    if (magic != NET_MAGIC || version != FILE_VERSION || n_layers < 2 || n_layers > TANN_MAX_LAYERS)
+        return NULL;
+
+    Dim dims[TANN_MAX_LAYERS];
+    int32_t acts[TANN_MAX_LAYERS];
+    for (int l = 0; l < n_layers; ++l) {
+        int32_t h, w;
+        if (read_int(file, &h) || read_int(file, &w) || read_int(file, &acts[l]))
+            return NULL;
+        if (h <= 0 || w <= 0 || acts[l] < ACT_SIGMOID || acts[l] > ACT_LINEAR)
+            return NULL;
+        if (l > 0 && h != dims[l - 1].w)
+            return NULL;
+        dims[l].h = h;
+        dims[l].w = w;
+    }
+
+    /* Hidden layers are inserted right after the inputs, so they are added from the back */
+    Dim in = {dims[0].h, dims[n_layers - 1].h};
+    NeuralNet *ann = create_net(in, dims[n_layers - 1]);
+    for (int l = n_layers - 2; l > 0; --l)
+        add_hidden_layer(ann, dims[l].h);
+
+    int l = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+        iter->act = (Activation) acts[l++];
+
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        for (int i = 0; i < iter->dim.h; ++i) {
+            if (fread(iter->weights[i], sizeof(float), iter->dim.w, file) != (size_t) iter->dim.w) {
+                free_net(ann);
+                return NULL;
+            }
+        }
+    }
+    net_changed(ann);
+
+    return ann;
+}
+
+
+/* Writes a buffer to path through a temporary file and an atomic rename */
+static int write_atomic(const char *path, const char *tmp_path, const Buffer *buf) {
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL)
+        return -1;
+
+    int ok = fwrite(buf->data, 1, buf->len, file) == buf->len;
+    ok = fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Saves a net into a binary file, returns 0 on success */
+int save_net(NeuralNet *ann, FILE *file) {
+    Buffer buf = {NULL, 0, 0};
+    serialize_net(&buf, ann);
+    int ok = fwrite(buf.data, 1, buf.len, file) == buf.len;
+    tann_free(buf.data);
+    return ok ? 0 : -1;
+}
+
+
+/* Loads a net saved by save_net, returns NULL on error */
+NeuralNet *load_net(FILE *file) {
+    return deserialize_net(file);
+}
+
+
+/* Saves a feature pipeline into a binary file, usually right after its net. Returns 0 on success. */
+int save_feature_pipeline(const FeaturePipeline *fp, FILE *file) {
+    Buffer buf = {NULL, 0, 0};
+    buffer_put_int(&buf, PIPELINE_MAGIC);
+    buffer_put_int(&buf, FILE_VERSION);
+    buffer_put_int(&buf, fp->n_ops);
+    for (int i = 0; i < fp->n_ops; ++i) {
+        buffer_put_int(&buf, fp->ops[i].kind);
+        buffer_put_int(&buf, fp->ops[i].a);
+        buffer_put_int(&buf, fp->ops[i].b);
+        buffer_put(&buf, &fp->ops[i].scale, sizeof(float));
+    }
+    int ok = fwrite(buf.data, 1, buf.len, file) == buf.len;
+    tann_free(buf.data);
+    return ok ? 0 : -1;
+}
+
+
+/* Loads a pipeline saved by save_feature_pipeline, returns NULL on error */
+FeaturePipeline *load_feature_pipeline(FILE *file) {
+    int32_t magic, version, n_ops;
+    if (read_int(file, &magic) || read_int(file, &version) || read_int(file, &n_ops))
+        return NULL;
+    if (magic != PIPELINE_MAGIC || version != FILE_VERSION || n_ops < 1 || n_ops > PIPELINE_MAX_COLUMNS)
+        return NULL;
+
+    FeatureOp *ops = (FeatureOp*) tann_alloc(sizeof(FeatureOp) * n_ops);
+    for (int i = 0; i < n_ops; ++i) {
+        int32_t kind, a, b;
+        if (read_int(file, &kind) || read_int(file, &a) || read_int(file, &b) ||
+            fread(&ops[i].scale, sizeof(float), 1, file) != 1 ||
+            kind < FEAT_BIAS || kind > FEAT_SQUARE ||
+            a < 0 || a >= PIPELINE_MAX_COLUMNS || b < 0 || b >= PIPELINE_MAX_COLUMNS) {
+            tann_free(ops);
+            return NULL;
+        }
+        ops[i].kind = (FeatureOpKind) kind;
+        ops[i].a = a;
+        ops[i].b = b;
+    }
+
+    FeaturePipeline *fp = create_feature_pipeline(ops, n_ops);
+    tann_free(ops);
+    return fp;
+}
+
+
+/* Writer thread: writes the pending snapshot whenever there is one */
+static void *checkpoint_writer(void *arg) {
+    Checkpoint *ckpt = (Checkpoint*) arg;
+
+    pthread_mutex_lock(&ckpt->lock);
+    for (;;) {
+        while (!ckpt->has_pending && !ckpt->stop)
+            pthread_cond_wait(&ckpt->cond, &ckpt->lock);
+        if (!ckpt->has_pending)
+            break;
+
+        Buffer tmp = ckpt->writing;
+        ckpt->writing = ckpt->pending;
+        ckpt->pending = tmp;
+        ckpt->has_pending = 0;
+        pthread_mutex_unlock(&ckpt->lock);
+
+        int res = write_atomic(ckpt->path, ckpt->tmp_path, &ckpt->writing);
+
+        pthread_mutex_lock(&ckpt->lock);
+        if (res != 0)
+            ckpt->failed = 1;
+    }
+    pthread_mutex_unlock(&ckpt->lock);
+
+    return NULL;
+}
+
+
+/* Starts checkpointing into path every every_epochs epochs or every_sec seconds (0 disables either) */
+Checkpoint *checkpoint_open(const char *path, int every_epochs, float every_sec) {
+    Checkpoint *ckpt = (Checkpoint*) tann_calloc(1, sizeof(Checkpoint));
+    ckpt->path = (char*) tann_alloc(strlen(path) + 1);
+    strcpy(ckpt->path, path);
+    ckpt->tmp_path = (char*) tann_alloc(strlen(path) + 5);
+    sprintf(ckpt->tmp_path, "%s.tmp", path);
+    ckpt->every_epochs = every_epochs;
+    ckpt->every_sec = every_sec;
+    ckpt->last_time = wall_time();
+
+    pthread_mutex_init(&ckpt->lock, NULL);
+    pthread_cond_init(&ckpt->cond, NULL);
+    if (pthread_create(&ckpt->thread, NULL, checkpoint_writer, ckpt) != 0) {
+        pthread_mutex_destroy(&ckpt->lock);
+        pthread_cond_destroy(&ckpt->cond);
+        tann_free(ckpt->path);
+        tann_free(ckpt->tmp_path);
+        tann_free(ckpt);
+        return NULL;
+    }
+
+    return ckpt;
+}
+
+
+/* Takes a snapshot after epoch training epochs if one is due, or always if force is set */
+void checkpoint_step(Checkpoint *ckpt, NeuralNet *ann, float *J, float *acc, int epoch, int force) {
+    double now = wall_time();
+    int due = force;
+    if (ckpt->every_epochs > 0 && epoch - ckpt->last_epoch >= ckpt->every_epochs)
+        due = 1;
+    if (ckpt->every_sec > 0 && now - ckpt->last_time >= ckpt->every_sec)
+        due = 1;
+    if (!due)
+        return;
+
+    /* The snapshot is built without the lock, the swap below is all the writer can block */
+    Buffer *buf = &ckpt->fill;
+    buf->len = 0;
+    buffer_put_int(buf, CHECKPOINT_MAGIC);
+    buffer_put_int(buf, FILE_VERSION);
+    buffer_put_int(buf, epoch);
+    buffer_put(buf, J, sizeof(float) * epoch);
+    buffer_put(buf, acc, sizeof(float) * epoch);
+    serialize_net(buf, ann);
+
+    pthread_mutex_lock(&ckpt->lock);
+    Buffer tmp = ckpt->pending;
+    ckpt->pending = ckpt->fill;
+    ckpt->fill = tmp;
+    ckpt->has_pending = 1;
+    pthread_cond_signal(&ckpt->cond);
+    pthread_mutex_unlock(&ckpt->lock);
+
+    ckpt->last_epoch = epoch;
+    ckpt->last_time = now;
+}
+
+
+/* Writes the last snapshot and stops the writer, returns 0 if every write succeeded */
+int checkpoint_close(Checkpoint *ckpt) {
+    pthread_mutex_lock(&ckpt->lock);
+    ckpt->stop = 1;
+    pthread_cond_signal(&ckpt->cond);
+    pthread_mutex_unlock(&ckpt->lock);
+    pthread_join(ckpt->thread, NULL);
+
+    int res = ckpt->failed ? -1 : 0;
+    pthread_mutex_destroy(&ckpt->lock);
+    pthread_cond_destroy(&ckpt->cond);
+    tann_free(ckpt->fill.data);
+    tann_free(ckpt->pending.data);
+    tann_free(ckpt->writing.data);
+    tann_free(ckpt->path);
+    tann_free(ckpt->tmp_path);
+    tann_free(ckpt);
+    return res;
+}
+
+
+/* Loads a checkpoint: returns the net and fills J, acc and the number of finished epochs.
+ * J and acc hold capacity floats each. Returns NULL on error, or if the checkpoint has
+ * more epochs than that, and then leaves J, acc and epoch untouched. */
+NeuralNet *resume_net(const char *path, float *J, float *acc, int capacity, int *epoch) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    int32_t magic, version, n;
+    NeuralNet *ann = NULL;
+    if (read_int(file, &magic) || read_int(file, &version) || read_int(file, &n) ||
+        magic != CHECKPOINT_MAGIC || version != FILE_VERSION || n < 0 || n > capacity) {
+        fclose(file);
+        return NULL;
+    }
+
+    /* The history is only copied out once the net is read too */
+    float *file_J = allocate_float_1d(n > 0 ? n : 1);
+    float *file_acc = allocate_float_1d(n > 0 ? n : 1);
+    if (fread(file_J, sizeof(float), n, file) == (size_t) n &&
+        fread(file_acc, sizeof(float), n, file) == (size_t) n)
+        ann = deserialize_net(file);
+    if (ann != NULL) {
+        memcpy(J, file_J, sizeof(float) * n);
+        memcpy(acc, file_acc, sizeof(float) * n);
+        *epoch = n;
+    }
+
+    free_float_1d(file_J);
+    free_float_1d(file_acc);
+    fclose(file);
+    return ann;
+}
@@ -0,0 +1,135 @@
+/*
+ * This file contains the model compiler. It walks a trained neural net
+ * and writes a standalone C source file with a static const weight table
+ * and a forward function unrolled for the exact size of every layer.
+ * The generated code needs neither this library nor malloc, so it can be
+ * dropped into an embedded project (ex.: Arduino) as it is. On AVR the
+ * weight table is placed in flash with PROGMEM and read with
+ * pgm_read_float, otherwise the startup code copies it into the few
+ * kilobytes of RAM.
+ *
+ */
+
+#include "perceptron.h"
+
+
+/* Writes the weight table of a layer */
+static void compile_weights(FILE *file, Layer *layer, const char *name, int idx) {
+    fprintf(file, "static const float %s_w%d[%d][%d] TANN_WEIGHT_MEM = {\n", name, idx, layer->dim.h, layer->dim.w);
+    for (int i = 0; i < layer->dim.h; ++i) {
+        fprintf(file, "    {");
+        for (int j = 0; j < layer->dim.w; ++j)
+            fprintf(file, "%s%.9gf", j > 0 ? ", " : "", layer->weights[i][j]);
+        fprintf(file, "}%s\n", i < layer->dim.h - 1 ? "," : "");
+    }
+    fprintf(file, "};\n\n");
+}
+
+
+/* Writes the function applied on a weighted sum, softmax is applied on the whole layer afterwards */
+static void compile_activation(FILE *file, Activation act, const char *name) {
+    switch (act) {
+        case ACT_SIGMOID:
+        case ACT_RELU:
+        case ACT_LEAKY_RELU:
+            fprintf(file, "%s_%s", name, activation_name(act));
+            break;
+        case ACT_TANH:
+            fprintf(file, "tanhf");
+            break;
+        default:
+            break;
+    }
+}
+
+
+/* Writes the unrolled weighted sums and activations of a layer */
+static void compile_layer(FILE *file, Layer *layer, const char *name, int idx, const char *in, const char *out) {
+    int softmax = layer->act == ACT_SOFTMAX;
+    for (int k = 0; k < layer->dim.w; ++k) {
+        fprintf(file, "    %s[%d] = ", out, k);
+        compile_activation(file, layer->act, name);
+        fprintf(file, "(");
+        for (int j = 0; j < layer->dim.h; ++j) {
+            fprintf(file, "%s%s[%d] * TANN_WEIGHT(%s_w%d[%d][%d])", j > 0 ? " + " : "", in, j, name, idx, j, k);
+            if (j % 4 == 3 && j < layer->dim.h - 1)
+                fprintf(file, "\n            ");
+        }
+        fprintf(file, ");\n");
+    }
+    if (softmax)
+        fprintf(file, "    %s_softmax(%s, %d);\n", name, out, layer->dim.w);
+}
+
+
+/* Generates a standalone C inference function from a trained net */
+void compile_net(NeuralNet *ann, FILE *file, const char *name) {
+    Layer *iter;
+    int idx = 0;
+
+    fprintf(file, "/*\n * Generated by TinY ANN compile_net(), do not edit.\n");
+    fprintf(file, " * Network: ");
+    for (iter = ann->input; iter != NULL; iter = iter->next)
+        fprintf(file, "%d-", iter->dim.h);
+    fprintf(file, "%d\n */\n\n#include <math.h>\n\n", ann->output->dim.w);
+
+    /* Guarded, so several generated files can be included in one translation unit */
+    fprintf(file, "#ifndef TANN_WEIGHT\n#ifdef __AVR__\n#include <avr/pgmspace.h>\n");
+    fprintf(file, "/* const data is copied into RAM on AVR, the weights stay in flash instead */\n");
+    fprintf(file, "#define TANN_WEIGHT_MEM PROGMEM\n#define TANN_WEIGHT(w) pgm_read_float(&(w))\n");
+    fprintf(file, "#else\n#define TANN_WEIGHT_MEM\n#define TANN_WEIGHT(w) (w)\n#endif\n#endif\n\n");
+
+    for (iter = ann->input; iter != NULL; iter = iter->next)
+        compile_weights(file, iter, name, idx++);
+
+    int used[ACT_LINEAR + 1] = {0};
+    for (iter = ann->input; iter != NULL; iter = iter->next)
+        used[iter->act] = 1;
+
+    if (used[ACT_SIGMOID]) {
+        fprintf(file, "static float %s_sigmoid(float x) {\n", name);
+        fprintf(file, "    return 1.0f / (1.0f + expf(-(x - 0.5f)));\n}\n\n");
+    }
+    if (used[ACT_RELU]) {
+        fprintf(file, "static float %s_relu(float x) {\n", name);
+        fprintf(file, "    return x > 0 ? x : 0;\n}\n\n");
+    }
+    if (used[ACT_LEAKY_RELU]) {
+        fprintf(file, "static float %s_leaky_relu(float x) {\n", name);
+        fprintf(file, "    return x > 0 ? x : %.9gf * x;\n}\n\n", TANN_LEAKY_SLOPE);
+    }
+
+    /* Any layer may be a softmax one, so the helper takes the width */
+    if (used[ACT_SOFTMAX]) {
+        fprintf(file, "static void %s_softmax(float *v, int n) {\n", name);
+        fprintf(file, "    float max = v[0], s = 0;\n");
+        fprintf(file, "    for (int i = 1; i < n; ++i)\n        if (v[i] > max)\n            max = v[i];\n");
+        fprintf(file, "    for (int i = 0; i < n; ++i) {\n        v[i] = expf(v[i] - max);\n        s += v[i];\n    }\n");
+        fprintf(file, "    for (int i = 0; i < n; ++i)\n        v[i] /= s;\n}\n\n");
+    }
+
+    fprintf(file, "/* x: %d input features, y: %d outputs */\n", ann->input->dim.h, ann->output->dim.w);
+    fprintf(file, "void %s_predict(const float *x, float *y) {\n", name);
+
+    idx = 0;
+    for (iter = ann->input; iter != NULL; iter = iter->next, ++idx)
+        if (iter->next != NULL)
+            fprintf(file, "    float h%d[%d];\n", idx, iter->dim.w);
+
+    idx = 0;
+    for (iter = ann->input; iter != NULL; iter = iter->next, ++idx) {
+        char in[16], out[16];
+        if (iter->prev == NULL)
+            sprintf(in, "x");
+        else
+            sprintf(in, "h%d", idx - 1);
+        if (iter->next == NULL)
+            sprintf(out, "y");
+        else
+            sprintf(out, "h%d", idx);
+
+        fprintf(file, "\n");
+        compile_layer(file, iter, name, idx, in, out);
+    }
+    fprintf(file, "}\n");
+}
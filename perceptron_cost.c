@@ -0,0 +1,191 @@
+/*
+ * This file contains the static cost model of a net. net_cost() walks the
+ * layers like print_net does and computes from their dimensions alone
+ * what a sample costs: parameters and their bytes, FLOPs of the forward
+ * and the backward pass, the activation memory the layer keeps and the
+ * arithmetic intensity of the forward pass. A multiply-add counts as two
+ * FLOPs and the activation functions are not counted, the same
+ * convention the benchmark harness uses for its GFLOP/s. Given the
+ * kernel throughput of a machine, the printers also estimate the latency
+ * of every layer and the samples per second of the whole net.
+ * calibrate_throughput() measures that throughput once on a reference
+ * net without any instrumentation, so the estimates also hold for
+ * shapes that were never run.
+ *
+ */
+
+#include "perceptron.h"
+
+/* Reference net and samples of calibrate_throughput */
+#define CAL_IN 128
+#define CAL_HIDDEN 256
+#define CAL_OUT 16
+#define CAL_SAMPLES 256
+#define CAL_MIN_SEC 0.2
+
+
+static void add_cost(LayerCost *total, const LayerCost *c) {
+    total->params += c->params;
+    total->param_bytes += c->param_bytes;
+    total->forward_flops += c->forward_flops;
+    total->backward_flops += c->backward_flops;
+    total->act_bytes += c->act_bytes;
+}
+
+
+/* Forward FLOPs per byte of weights, inputs and outputs read or written by a sample */
+static float intensity(const LayerCost *c, int in_w, int out_w) {
+    size_t bytes = c->param_bytes + sizeof(float) * (size_t) (in_w + out_w);
+    return bytes > 0 ? (float) (c->forward_flops / (double) bytes) : 0;
+}
+
+
+/* Computes the cost of every layer of a net and their total. Layers past
+ * TANN_MAX_LAYERS only count in the total. */
+void net_cost(NeuralNet *ann, NetCost *cost) {
+    memset(cost, 0, sizeof(NetCost));
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        LayerCost c;
+        memset(&c, 0, sizeof(LayerCost));
+        c.dim = iter->dim;
+        c.act = iter->act;
+        c.params = (long) iter->dim.h * iter->dim.w;
+        c.param_bytes = sizeof(float) * (size_t) c.params;
+        c.forward_flops = 2.0 * (double) c.params;
+        /* The weight update, and every layer but the first also passes its delta back */
+        c.backward_flops = (iter->prev != NULL ? 4.0 : 2.0) * (double) c.params;
+        c.act_bytes = sizeof(float) * 3 * (size_t) iter->dim.w; /* in, out and delta */
+        c.intensity = intensity(&c, iter->dim.h, iter->dim.w);
+
+        if (cost->n_layers < TANN_MAX_LAYERS)
+            cost->layer[cost->n_layers] = c;
+        cost->n_layers++;
+        add_cost(&cost->total, &c);
+    }
+    cost->total.dim.h = ann->input->dim.h;
+    cost->total.dim.w = ann->output->dim.w;
+    cost->total.act = ann->output->act;
+
+    /* Every weight is read once per sample, the activations between layers stay in cache */
+    cost->total.intensity = intensity(&cost->total, ann->input->dim.h, ann->output->dim.w);
+}
+
+
+/* Estimated nanoseconds per sample of a layer or a net at gflops GFLOP/s (which is FLOP/ns).
+ * train adds the backward pass. Returns 0 if gflops is not positive. */
+double cost_latency_ns(const LayerCost *c, double gflops, int train) {
+    if (gflops <= 0)
+        return 0;
+    return (c->forward_flops + (train ? c->backward_flops : 0)) / gflops;
+}
+
+
+static void print_layer_cost(FILE *file, const char *name, const LayerCost *c,
+                             double forward_gflops, double train_gflops) {
+    fprintf(file, "%-8s %5d x %-5d %10ld %10lu %12.0f %12.0f %10lu %9.3f",
+            name, c->dim.h, c->dim.w, c->params, (unsigned long) c->param_bytes, c->forward_flops,
+            c->backward_flops, (unsigned long) c->act_bytes, c->intensity);
+    if (forward_gflops > 0 || train_gflops > 0)
+        fprintf(file, " %11.1f %11.1f", cost_latency_ns(c, forward_gflops, 0), cost_latency_ns(c, train_gflops, 1));
+    fprintf(file, "\n");
+}
+
+
+/* Prints the cost table of a net. With the GFLOP/s of the forward pass and of training on the
+ * machine, as measured by calibrate_throughput (0 leaves them out), it also estimates the latencies. */
+void print_net_cost(FILE *file, const NetCost *cost, double forward_gflops, double train_gflops) {
+    int estimate = forward_gflops > 0 || train_gflops > 0;
+    fprintf(file, "%-8s %13s %10s %10s %12s %12s %10s %9s", "Layer", "Shape", "Params", "Bytes",
+            "Fwd FLOPs", "Bwd FLOPs", "Act bytes", "FLOP/B");
+    if (estimate)
+        fprintf(file, " %11s %11s", "Fwd ns", "Train ns");
+    fprintf(file, "\n");
+
+    int n = cost->n_layers < TANN_MAX_LAYERS ? cost->n_layers : TANN_MAX_LAYERS;
+    for (int i = 0; i < n; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "%d", i);
+        print_layer_cost(file, name, &cost->layer[i], forward_gflops, train_gflops);
+    }
+    print_layer_cost(file, "Total", &cost->total, forward_gflops, train_gflops);
+
+    if (forward_gflops > 0)
+        fprintf(file, "Estimated inference throughput: %0.0f samples/sec\n",
+                1e9 / cost_latency_ns(&cost->total, forward_gflops, 0));
+    if (train_gflops > 0)
+        fprintf(file, "Estimated training throughput:  %0.0f samples/sec\n",
+                1e9 / cost_latency_ns(&cost->total, train_gflops, 1));
+}
+
+
+static void print_layer_cost_json(FILE *file, const LayerCost *c, double forward_gflops, double train_gflops) {
+    fprintf(file, "{\"in\": %d, \"out\": %d, \"params\": %ld, \"param_bytes\": %lu, \"forward_flops\": %f, "
+            "\"backward_flops\": %f, \"act_bytes\": %lu, \"intensity\": %f",
+            c->dim.h, c->dim.w, c->params, (unsigned long) c->param_bytes, c->forward_flops,
+            c->backward_flops, (unsigned long) c->act_bytes, c->intensity);
+    if (forward_gflops > 0)
+        fprintf(file, ", \"forward_ns\": %f", cost_latency_ns(c, forward_gflops, 0));
+    if (train_gflops > 0)
+        fprintf(file, ", \"train_ns\": %f", cost_latency_ns(c, train_gflops, 1));
+    fprintf(file, "}");
+}
+
+
+/* Same as print_net_cost as one JSON object */
+void print_net_cost_json(FILE *file, const NetCost *cost, double forward_gflops, double train_gflops) {
+    fprintf(file, "{\"layers\": [");
+    int n = cost->n_layers < TANN_MAX_LAYERS ? cost->n_layers : TANN_MAX_LAYERS;
+    for (int i = 0; i < n; ++i) {
+        fprintf(file, "%s", i > 0 ? ", " : "");
+        print_layer_cost_json(file, &cost->layer[i], forward_gflops, train_gflops);
+    }
+    fprintf(file, "], \"total\": ");
+    print_layer_cost_json(file, &cost->total, forward_gflops, train_gflops);
+    fprintf(file, "}\n");
+}
+
+
+/* Measures the forward and the training GFLOP/s of this machine on a reference net of
+ * CAL_IN-CAL_HIDDEN-CAL_OUT sigmoid neurons, with the stats of the thread detached. Each is
+ * timed for at least CAL_MIN_SEC seconds. Draws from the calling thread's random stream. */
+void calibrate_throughput(double *forward_gflops, double *train_gflops) {
+    tann_stats *stats = tann_stats_active();
+    tann_stats_attach(NULL);
+
+    Dim in = {CAL_IN, CAL_HIDDEN}, out = {CAL_HIDDEN, CAL_OUT}, dim = {CAL_SAMPLES, CAL_IN};
+    NeuralNet *ann = create_net(in, out);
+    float **X = allocate_float_2d(CAL_SAMPLES, CAL_IN);
+    float **y = allocate_float_2d(CAL_SAMPLES, CAL_OUT);
+    for (int i = 0; i < CAL_SAMPLES; ++i)
+        for (int j = 0; j < CAL_IN; ++j)
+            X[i][j] = rand_float();
+    NetCost cost;
+    net_cost(ann, &cost);
+
+    /* Warm-up */
+    for (int i = 0; i < CAL_SAMPLES; ++i)
+        feed_forward_net(ann, X[i]);
+
+    long n = 0;
+    double start = wall_time(), sec;
+    do {
+        for (int i = 0; i < CAL_SAMPLES; ++i)
+            feed_forward_net(ann, X[i]);
+        n += CAL_SAMPLES;
+    } while ((sec = wall_time() - start) < CAL_MIN_SEC);
+    *forward_gflops = cost.total.forward_flops * (double) n / sec * 1e-9;
+
+    n = 0;
+    start = wall_time();
+    do {
+        float J, acc;
+        train_epoch(ann, X, y, dim, &J, &acc);
+        n += CAL_SAMPLES;
+    } while ((sec = wall_time() - start) < CAL_MIN_SEC);
+    *train_gflops = (cost.total.forward_flops + cost.total.backward_flops) * (double) n / sec * 1e-9;
+
+    free_net(ann);
+    free_float_2d(X, CAL_SAMPLES);
+    free_float_2d(y, CAL_SAMPLES);
+    tann_stats_attach(stats);
+}
@@ -0,0 +1,140 @@
+/*
+ * This file contains the k-fold cross-validation runner. The folds are
+ * index views: after one shuffle of the row indices every fold only gets
+ * arrays of row pointers into the caller's dataset, so nothing is copied.
+ * The folds are trained concurrently, each on its own copy of a prototype
+ * net, and evaluated on their held-out rows with eval_net. The metrics
+ * of the folds are aggregated into mean and standard deviation.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include "perceptron.h"
+
+
+/* Shared state of the fold threads */
+typedef struct CVJob {
+    NeuralNet *proto;
+    float **X, **y;
+    const int *order; /* shuffled row indices, fold f owns a contiguous slice */
+    int n, k, n_epoch;
+    int next_fold; /* next fold to train, taken atomically */
+    EvalResult *folds;
+} CVJob;
+
+
+/* Trains and evaluates a single fold on views of the dataset */
+static void run_fold(CVJob *job, int f) {
+    int from = (int) ((long) job->n * f / job->k);
+    int to = (int) ((long) job->n * (f + 1) / job->k);
+    Dim train_dim = {job->n - (to - from), 0};
+    Dim test_dim = {to - from, 0};
+
+    float **train_X = (float**) tann_alloc(sizeof(float*) * (train_dim.h > 0 ? train_dim.h : 1));
+    float **train_y = (float**) tann_alloc(sizeof(float*) * (train_dim.h > 0 ? train_dim.h : 1));
+    float **test_X = (float**) tann_alloc(sizeof(float*) * (test_dim.h > 0 ? test_dim.h : 1));
+    float **test_y = (float**) tann_alloc(sizeof(float*) * (test_dim.h > 0 ? test_dim.h : 1));
+    int a = 0, b = 0;
+    for (int i = 0; i < job->n; ++i) {
+        int row = job->order[i];
+        if (i >= from && i < to) {
+            test_X[b] = job->X[row];
+            test_y[b++] = job->y[row];
+        } else {
+            train_X[a] = job->X[row];
+            train_y[a++] = job->y[row];
+        }
+    }
+
+    NeuralNet *ann = copy_net(job->proto);
+    for (int step = 0; step < job->n_epoch && train_dim.h > 0; ++step) {
+        float J, acc;
+        train_epoch(ann, train_X, train_y, train_dim, &J, &acc);
+    }
+    eval_net(ann, test_X, test_y, test_dim, 1, &job->folds[f]);
+
+    free_net(ann);
+    tann_free(train_X);
+    tann_free(train_y);
+    tann_free(test_X);
+    tann_free(test_y);
+}
+
+
+static void *fold_worker(void *arg) {
+    CVJob *job = (CVJob*) arg;
+    int f;
+    while ((f = __atomic_fetch_add(&job->next_fold, 1, __ATOMIC_SEQ_CST)) < job->k)
+        run_fold(job, f);
+    return NULL;
+}
+
+
+/* k-fold cross-validation of proto (left untouched) trained for n_epoch epochs per fold on
+ * n_threads threads. folds receives the metrics of every fold if not NULL. */
+void cross_validate(int k, NeuralNet *proto, float **X, float **y, Dim dim, int n_epoch,
+                    int n_threads, CVResult *res, EvalResult *folds) {
+    if (k < 2)
+        k = 2;
+    if (k > dim.h)
+        k = dim.h;
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > k)
+        n_threads = k;
+
+    /* One shuffle of the indices decides the folds, it draws from the calling thread's stream */
+    int *order = (int*) tann_alloc(sizeof(int) * (dim.h > 0 ? dim.h : 1));
+    for (int i = 0; i < dim.h; ++i)
+        order[i] = i;
+    for (int i = dim.h - 1; i > 0; --i) {
+        int j = (int) (tann_rand() % (uint32_t) (i + 1));
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    CVJob job = {proto, X, y, order, dim.h, k, n_epoch, 0, NULL};
+    job.folds = folds != NULL ? folds : (EvalResult*) tann_alloc(sizeof(EvalResult) * k);
+    pthread_t *threads = (pthread_t*) tann_alloc(sizeof(pthread_t) * n_threads);
+    double start = wall_time();
+
+    /* The folds are taken from a shared counter, so the threads that did start finish them all */
+    int *started = (int*) tann_calloc(n_threads, sizeof(int));
+    for (int t = 1; t < n_threads; ++t)
+        started[t] = pthread_create(&threads[t], NULL, fold_worker, &job) == 0;
+    fold_worker(&job);
+    for (int t = 1; t < n_threads; ++t)
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    tann_free(started);
+
+    memset(res, 0, sizeof(CVResult));
+    res->k = k;
+    res->train_sec = wall_time() - start;
+    for (int f = 0; f < k; ++f) {
+        res->accuracy += job.folds[f].accuracy / (float) k;
+        res->rmse += job.folds[f].rmse / (float) k;
+        res->mae += job.folds[f].mae / (float) k;
+        res->auc += job.folds[f].auc / (float) k;
+    }
+    for (int f = 0; f < k; ++f) {
+        float d = job.folds[f].accuracy - res->accuracy;
+        res->accuracy_std += d * d / (float) k;
+    }
+    res->accuracy_std = sqrtf(res->accuracy_std);
+
+    if (folds == NULL)
+        tann_free(job.folds);
+    tann_free(threads);
+    tann_free(order);
+}
+
+
+/* Prints the aggregated metrics of a cross-validation */
+void print_cv_result(FILE *file, const CVResult *res) {
+    fprintf(file, "%d-fold cross-validation took: %0.3f sec\n", res->k, res->train_sec);
+    fprintf(file, "Accuracy: %f +- %f\n", res->accuracy, res->accuracy_std);
+    fprintf(file, "Root Mean Squared Error: %f   Mean Absolute Error: %f   AUC: %f\n", res->rmse, res->mae, res->auc);
+}
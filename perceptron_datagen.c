@@ -0,0 +1,298 @@
+/*
+ * This file contains the bulk synthetic dataset generators used for
+ * large scale stress tests. Unlike create_clusters() and friends they
+ * don't use rejection sampling: every point is mapped directly from
+ * uniform numbers into its region, in float, over blocks of rows. Block b
+ * always uses stream b of the seed, so the output is the same for any
+ * number of threads. Datasets can also be streamed straight into a
+ * binary file without holding them in memory.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <limits.h>
+#include <pthread.h>
+#include "perceptron.h"
+
+#define DATASET_MAGIC 0x41444E54 /* "TNDA" */
+#define DATASET_VERSION 1
+#define GEN_BLOCK 4096
+#define GEN_PI 3.14159265f
+#define CHESS_DIST 0.02f
+
+
+/* Shape of the clusters, derived from the seed only */
+typedef struct ClusterShape {
+    float ax, ay, bx, by, size;
+} ClusterShape;
+
+
+/* Work of a single generator thread */
+typedef struct GenWorker {
+    DatasetKind kind;
+    FeaturePipeline *features; /* expansion of the spiral rows */
+    uint64_t seed;
+    ClusterShape shape;
+    float *data; /* rows of the current chunk */
+    long first_row; /* global index of the first row of the chunk */
+    long n_rows; /* rows in the chunk */
+    long n_total; /* rows in the whole dataset */
+    int width;
+    int thread, n_threads;
+} GenWorker;
+
+
+/* Number of features generated for a dataset kind */
+int dataset_width(DatasetKind kind) {
+    return kind == DATA_SPIRAL ? 8 : 3;
+}
+
+
+/* Allocates a dataset with n contiguous rows of w features and a label. Returns NULL if n is
+ * negative or larger than INT_MAX (the row count of a Dim), or if the memory can't be allocated. */
+Dataset *create_dataset(long n, int w) {
+    if (n < 0 || n > INT_MAX || w < 0 || w == INT_MAX ||
+        (size_t) n > SIZE_MAX / sizeof(float) / ((size_t) w + 1))
+        return NULL;
+
+    Dataset *ds = (Dataset*) tann_calloc(1, sizeof(Dataset));
+    if (ds == NULL)
+        return NULL;
+    ds->dim.h = (int) n;
+    ds->dim.w = w;
+    ds->data = (float*) tann_alloc(sizeof(float) * (size_t) n * ((size_t) w + 1));
+    ds->X = (float**) tann_alloc(sizeof(float*) * (size_t) n);
+    ds->y = (float**) tann_alloc(sizeof(float*) * (size_t) n);
+    if (ds->data == NULL || ds->X == NULL || ds->y == NULL) {
+        free_dataset(ds);
+        return NULL;
+    }
+    for (long i = 0; i < n; ++i) {
+        ds->X[i] = &ds->data[i * (w + 1)];
+        ds->y[i] = &ds->data[i * (w + 1) + w];
+    }
+    return ds;
+}
+
+
+/* Free function for a dataset, NULL is ignored */
+void free_dataset(Dataset *ds) {
+    if (ds == NULL)
+        return;
+    tann_free(ds->data);
+    tann_free(ds->X);
+    tann_free(ds->y);
+    tann_free(ds);
+}
+
+
+static ClusterShape cluster_shape(uint64_t seed) {
+    ClusterShape s;
+    tann_rng rng;
+    tann_rng_seed(&rng, seed, UINT64_MAX);
+
+    /* Same limits as create_clusters: centers at least 0.9 apart, radius in (0.3, 0.35) */
+    do {
+        s.ax = tann_rng_float(&rng);
+        s.ay = tann_rng_float(&rng);
+        s.bx = tann_rng_float(&rng);
+        s.by = tann_rng_float(&rng);
+    } while (dist(s.ax, s.ay, s.bx, s.by) < 0.9f);
+    s.size = 0.3f + 0.05f * tann_rng_float(&rng);
+    return s;
+}
+
+
+/* Generates count rows starting at global row first into dst */
+static void generate_block(GenWorker *w, float *dst, long first, int count) {
+    float u[GEN_BLOCK], v[GEN_BLOCK], c[GEN_BLOCK];
+    float *rows[GEN_BLOCK];
+    int stride = w->width + 1;
+    tann_rng rng;
+    tann_rng_seed(&rng, w->seed, (uint64_t) (first / GEN_BLOCK));
+    tann_rng_fill(&rng, u, count);
+    tann_rng_fill(&rng, v, count);
+    tann_rng_fill(&rng, c, count);
+
+    switch (w->kind) {
+        case DATA_CLUSTERS:
+            for (int i = 0; i < count; ++i) {
+                float *row = &dst[i * stride];
+                int a = c[i] < 0.5f;
+                float r = w->shape.size * sqrtf(u[i]);
+                float phi = 2 * GEN_PI * v[i];
+                row[0] = 1;
+                row[1] = (a ? w->shape.ax : w->shape.bx) + r * cosf(phi);
+                row[2] = (a ? w->shape.ay : w->shape.by) + r * sinf(phi);
+                row[3] = (float) a;
+            }
+            break;
+
+        case DATA_CIRCLES:
+            for (int i = 0; i < count; ++i) {
+                float *row = &dst[i * stride];
+                /* The inner disk (r < 0.15) and the ring (0.25 < r < 0.4) get points in proportion to their area */
+                int inner = c[i] < 0.0225f / (0.0225f + 0.16f - 0.0625f);
+                float r0 = inner ? 0 : 0.0625f, r1 = inner ? 0.0225f : 0.16f;
+                float r = sqrtf(r0 + u[i] * (r1 - r0));
+                float phi = 2 * GEN_PI * v[i];
+                row[0] = 1;
+                row[1] = 0.5f + r * cosf(phi);
+                row[2] = 0.5f + r * sinf(phi);
+                row[3] = (float) inner;
+            }
+            break;
+
+        case DATA_CHESSTABLE:
+            for (int i = 0; i < count; ++i) {
+                float *row = &dst[i * stride];
+                int q = (int) (c[i] * 4);
+                int right = q & 1, top = q >> 1;
+                float side = 0.5f - CHESS_DIST;
+                row[0] = 1;
+                row[1] = right ? 0.5f + CHESS_DIST + u[i] * side : u[i] * side;
+                row[2] = top ? 0.5f + CHESS_DIST + v[i] * side : v[i] * side;
+                row[3] = (float) (right != top);
+            }
+            break;
+
+        case DATA_SPIRAL:
+            for (int i = 0; i < count; ++i) {
+                float *row = &dst[i * stride];
+                /* Same curve as create_spiral: two arms of r = 0.4 * t mirrored around (0.5, 0.5) */
+                float t = (float) (first + i) / (float) w->n_total;
+                float sign = c[i] < 0.5f ? 1.0f : -1.0f;
+                row[0] = 1;
+                row[1] = 0.5f + sign * 0.4f * t * cosf(t * 10);
+                row[2] = 0.5f + sign * 0.4f * t * sinf(t * 10);
+                row[8] = sign < 0;
+                rows[i] = row;
+            }
+            feature_pipeline_apply(w->features, rows, rows, count);
+            break;
+    }
+}
+
+
+/* Generates every n_threads-th block of a chunk */
+static void *generate_worker(void *arg) {
+    GenWorker *w = (GenWorker*) arg;
+    long n_blocks = (w->n_rows + GEN_BLOCK - 1) / GEN_BLOCK;
+
+    for (long b = w->thread; b < n_blocks; b += w->n_threads) {
+        long from = b * GEN_BLOCK;
+        long count = w->n_rows - from < GEN_BLOCK ? w->n_rows - from : GEN_BLOCK;
+        generate_block(w, &w->data[from * (w->width + 1)], w->first_row + from, (int) count);
+    }
+    return NULL;
+}
+
+
+/* Generates rows [first, first + n) of a dataset of n_total rows into data on n_threads threads */
+static void generate_chunk(DatasetKind kind, uint64_t seed, float *data, long first, long n,
+                           long n_total, int n_threads) {
+    if (n_threads < 1)
+        n_threads = 1;
+
+    GenWorker *workers = (GenWorker*) tann_alloc(sizeof(GenWorker) * n_threads);
+    pthread_t *threads = (pthread_t*) tann_alloc(sizeof(pthread_t) * n_threads);
+    ClusterShape shape = cluster_shape(seed);
+    FeaturePipeline *features = spiral_features();
+
+    for (int t = 0; t < n_threads; ++t) {
+        workers[t].kind = kind;
+        workers[t].features = features;
+        workers[t].seed = seed;
+        workers[t].shape = shape;
+        workers[t].data = data;
+        workers[t].first_row = first;
+        workers[t].n_rows = n;
+        workers[t].n_total = n_total;
+        workers[t].width = dataset_width(kind);
+        workers[t].thread = t;
+        workers[t].n_threads = n_threads;
+    }
+
+    /* A slice whose thread can't be started is generated by the calling thread */
+    int *started = (int*) tann_calloc(n_threads, sizeof(int));
+    for (int t = 1; t < n_threads; ++t)
+        started[t] = pthread_create(&threads[t], NULL, generate_worker, &workers[t]) == 0;
+    for (int t = 0; t < n_threads; ++t)
+        if (!started[t])
+            generate_worker(&workers[t]);
+    for (int t = 1; t < n_threads; ++t)
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    tann_free(started);
+
+    free_feature_pipeline(features);
+    tann_free(workers);
+    tann_free(threads);
+}
+
+
+/* Generates n labeled samples in parallel, the result only depends on the seed.
+ * Returns NULL under the same conditions as create_dataset. */
+Dataset *generate_dataset(DatasetKind kind, long n, uint64_t seed, int n_threads) {
+    Dataset *ds = create_dataset(n, dataset_width(kind));
+    if (ds == NULL)
+        return NULL;
+    generate_chunk(kind, seed, ds->data, 0, n, n, n_threads);
+    return ds;
+}
+
+
+/* Streams a generated dataset into a binary file chunk by chunk, returns 0 on success */
+int generate_dataset_file(const char *path, DatasetKind kind, long n, uint64_t seed, int n_threads) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return -1;
+
+    int32_t header[3] = {DATASET_MAGIC, DATASET_VERSION, dataset_width(kind)};
+    int64_t rows = n;
+    int ok = fwrite(header, sizeof(header), 1, file) == 1 && fwrite(&rows, sizeof(rows), 1, file) == 1;
+
+    int stride = dataset_width(kind) + 1;
+    long chunk = (long) GEN_BLOCK * (n_threads > 0 ? n_threads : 1) * 16;
+    float *data = (float*) tann_alloc(sizeof(float) * chunk * stride);
+
+    for (long first = 0; ok && first < n; first += chunk) {
+        long count = n - first < chunk ? n - first : chunk;
+        generate_chunk(kind, seed, data, first, count, n, n_threads);
+        ok = fwrite(data, sizeof(float) * stride, count, file) == (size_t) count;
+    }
+
+    tann_free(data);
+    ok = fclose(file) == 0 && ok;
+    return ok ? 0 : -1;
+}
+
+
+/* Loads a dataset written by generate_dataset_file, returns NULL on error */
+Dataset *load_dataset_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    int32_t header[3];
+    int64_t rows;
+    Dataset *ds = NULL;
+    if (fread(header, sizeof(header), 1, file) == 1 && fread(&rows, sizeof(rows), 1, file) == 1 &&
+        header[0] == DATASET_MAGIC && header[1] == DATASET_VERSION && header[2] > 0 &&
+        header[2] < INT_MAX && rows >= 0 && rows <= INT_MAX) {
+        /* A corrupt row count must not allocate more than the file holds */
+        long start = ftell(file), end = -1;
+        if (start >= 0 && fseek(file, 0, SEEK_END) == 0)
+            end = ftell(file);
+        int fits = start >= 0 && end >= start && fseek(file, start, SEEK_SET) == 0 &&
+                   rows <= (int64_t) (end - start) / ((int64_t) sizeof(float) * ((int64_t) header[2] + 1));
+        ds = fits ? create_dataset((long) rows, header[2]) : NULL;
+        if (ds != NULL && fread(ds->data, sizeof(float) * (header[2] + 1), rows, file) != (size_t) rows) {
+            free_dataset(ds);
+            ds = NULL;
+        }
+    }
+
+    fclose(file);
+    return ds;
+}
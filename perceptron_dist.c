@@ -0,0 +1,389 @@
+/*
+ * This file contains synchronous data-parallel training over several
+ * processes. The calling process forks n_workers - 1 workers, every
+ * process trains on its own shard of the dataset and every step ends with
+ * a ring all-reduce of the gradients, so all copies of the net make the
+ * same update and stay identical. The ring runs either over a shared
+ * memory segment with a barrier between the rounds, or over Unix domain
+ * sockets between neighbours, which is the same exchange that would run
+ * between machines. A process that dies is noticed either way: a socket
+ * reaches end of file, and a process waiting at the barrier checks that
+ * the others are still alive, so the rest give up instead of hanging.
+ *
+ * The ring splits the gradient into one chunk per process. In n - 1
+ * reduce-scatter rounds every process adds the chunk of its left
+ * neighbour to its own, after which each process holds the full sum of
+ * one chunk, and n - 1 all-gather rounds pass the summed chunks around.
+ * Every process sends and receives 2 (n - 1) / n gradients per step,
+ * whatever the number of processes.
+ *
+ */
+
+#define _GNU_SOURCE /* MAP_ANONYMOUS */
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "perceptron.h"
+
+/* Yields at the shared memory barrier before a waiting process starts sleeping and checking
+ * that the others are alive */
+#define DIST_SPIN 1000
+
+
+/* Loss and correct predictions of a worker in the current epoch */
+typedef struct DistTotals {
+    double loss;
+    long correct;
+} DistTotals;
+
+
+/* Segment shared by the processes, the gradients of the workers follow it */
+typedef struct DistShared {
+    unsigned arrived; /* processes at the current barrier */
+    unsigned generation; /* barriers passed */
+    int abort; /* set by a process that gives up, the others leave the barrier */
+    DistTotals totals[];
+} DistShared;
+
+
+/* What a process knows about the ring */
+typedef struct DistRing {
+    int rank, n;
+    int n_params;
+    pid_t parent; /* the calling process, rank 0 */
+    const pid_t *pids; /* pids of the workers, read by rank 0 */
+    DistTransport transport;
+    DistShared *shared;
+    float *grads; /* n gradients in shared memory */
+    int left_fd, right_fd; /* sockets to the neighbours */
+    float *recv; /* receive buffer of a chunk */
+} DistRing;
+
+
+/* Returns 1 if a process of the ring has ended: rank 0 looks at its children without reaping
+ * them, a worker checks that it still has the same parent */
+static int peer_gone(const DistRing *ring) {
+    if (ring->rank != 0)
+        return getppid() != ring->parent;
+    for (int r = 1; r < ring->n; ++r) {
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PID, (id_t) ring->pids[r], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Waits until every process has arrived, returns -1 if the ring was aborted or a process is gone */
+static int dist_barrier(DistRing *ring) {
+    DistShared *sh = ring->shared;
+    unsigned gen = __atomic_load_n(&sh->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&sh->arrived, 1, __ATOMIC_ACQ_REL) == (unsigned) ring->n) {
+        __atomic_store_n(&sh->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh->generation, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    struct timespec nap = {0, 100000};
+    for (long wait = 0;; ++wait) {
+        if (__atomic_load_n(&sh->generation, __ATOMIC_ACQUIRE) != gen)
+            return 0;
+        if (__atomic_load_n(&sh->abort, __ATOMIC_ACQUIRE))
+            return -1;
+        if (wait < DIST_SPIN) {
+            sched_yield();
+            continue;
+        }
+        nanosleep(&nap, NULL);
+        /* A process that passed this barrier may exit at once, so only a dead process
+         * that never let the barrier open counts */
+        if (peer_gone(ring) &&
+            __atomic_load_n(&sh->generation, __ATOMIC_ACQUIRE) == gen) {
+            __atomic_store_n(&sh->abort, 1, __ATOMIC_RELEASE);
+            return -1;
+        }
+    }
+}
+
+
+/* First parameter of chunk c */
+static int chunk_start(const DistRing *ring, int c) {
+    return (int) ((long) ring->n_params * c / ring->n);
+}
+
+
+/* Sends a buffer to the right neighbour while receiving one from the left, polling both
+ * sockets so that no process can block in a send while its neighbour does the same */
+static int exchange(const DistRing *ring, const void *send_buf, size_t send_n, void *recv_buf, size_t recv_n) {
+    size_t sent = 0, received = 0;
+    while (sent < send_n || received < recv_n) {
+        /* A finished direction is left out, poll ignores negative descriptors */
+        struct pollfd fds[2] = {{sent < send_n ? ring->right_fd : -1, POLLOUT, 0},
+                                {received < recv_n ? ring->left_fd : -1, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (sent < send_n && (fds[0].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            ssize_t k = write(ring->right_fd, (const char*) send_buf + sent, send_n - sent);
+            if (k < 0 && errno != EAGAIN && errno != EINTR)
+                return -1;
+            sent += k > 0 ? (size_t) k : 0;
+        }
+        if (received < recv_n && (fds[1].revents & (POLLIN | POLLERR | POLLHUP))) {
+            ssize_t k = read(ring->left_fd, (char*) recv_buf + received, recv_n - received);
+            if (k == 0 || (k < 0 && errno != EAGAIN && errno != EINTR))
+                return -1;
+            received += k > 0 ? (size_t) k : 0;
+        }
+    }
+    return 0;
+}
+
+
+/* Sums grad over all processes in place, returns -1 if a process is gone. With shared memory
+ * grad is the buffer of the process in the segment and every round starts with a barrier, so
+ * a chunk is only read after its owner has finished writing it. */
+static int ring_allreduce(DistRing *ring, float *grad) {
+    int n = ring->n, r = ring->rank;
+    float *left = ring->grads != NULL ? &ring->grads[(size_t) ((r + n - 1) % n) * ring->n_params] : NULL;
+
+    /* Reduce-scatter: in round s the chunk r - s - 1 of the left neighbour is added */
+    for (int s = 0; s < n - 1; ++s) {
+        int send_c = (r - s + n) % n, recv_c = (r - s - 1 + 2 * n) % n;
+        int from = chunk_start(ring, recv_c), to = chunk_start(ring, recv_c + 1);
+        if (ring->transport == DIST_SHM) {
+            if (dist_barrier(ring) != 0)
+                return -1;
+            for (int i = from; i < to; ++i)
+                grad[i] += left[i];
+        } else {
+            int send_from = chunk_start(ring, send_c), send_to = chunk_start(ring, send_c + 1);
+            if (exchange(ring, &grad[send_from], sizeof(float) * (size_t) (send_to - send_from),
+                         ring->recv, sizeof(float) * (size_t) (to - from)) != 0)
+                return -1;
+            for (int i = from; i < to; ++i)
+                grad[i] += ring->recv[i - from];
+        }
+    }
+
+    /* All-gather: process r holds the sum of chunk r + 1, in round s it takes chunk r - s */
+    for (int s = 0; s < n - 1; ++s) {
+        int send_c = (r + 1 - s + n) % n, recv_c = (r - s + n) % n;
+        int from = chunk_start(ring, recv_c), to = chunk_start(ring, recv_c + 1);
+        if (ring->transport == DIST_SHM) {
+            if (dist_barrier(ring) != 0)
+                return -1;
+            memcpy(&grad[from], &left[from], sizeof(float) * (size_t) (to - from));
+        } else {
+            int send_from = chunk_start(ring, send_c), send_to = chunk_start(ring, send_c + 1);
+            if (exchange(ring, &grad[send_from], sizeof(float) * (size_t) (send_to - send_from),
+                         &grad[from], sizeof(float) * (size_t) (to - from)) != 0)
+                return -1;
+        }
+    }
+
+    /* The neighbours may read this buffer until everybody is done */
+    if (ring->transport == DIST_SHM)
+        return dist_barrier(ring);
+    return 0;
+}
+
+
+/* Sums the epoch totals of the processes into every process */
+static int reduce_totals(DistRing *ring, DistTotals *t) {
+    if (ring->transport == DIST_SHM) {
+        ring->shared->totals[ring->rank] = *t;
+        if (dist_barrier(ring) != 0)
+            return -1;
+        DistTotals sum = {0, 0};
+        for (int i = 0; i < ring->n; ++i) {
+            sum.loss += ring->shared->totals[i].loss;
+            sum.correct += ring->shared->totals[i].correct;
+        }
+        /* Nobody may overwrite its totals before everybody has read them */
+        *t = sum;
+        return dist_barrier(ring);
+    }
+
+    /* Every value travels once around the ring, each process adds what passes by */
+    DistTotals pass = *t, in;
+    for (int s = 0; s < ring->n - 1; ++s) {
+        if (exchange(ring, &pass, sizeof(pass), &in, sizeof(in)) != 0)
+            return -1;
+        t->loss += in.loss;
+        t->correct += in.correct;
+        pass = in;
+    }
+    return 0;
+}
+
+
+/* Trains the copy of the net of one process, returns 0 on success */
+static int run_worker(DistRing *ring, NeuralNet *ann, float **X, float **y, Dim dim,
+                      int n_epoch, int batch, float *J, float *acc) {
+    int from = (int) ((long) dim.h * ring->rank / ring->n);
+    int to = (int) ((long) dim.h * (ring->rank + 1) / ring->n);
+    int max_shard = (dim.h + ring->n - 1) / ring->n;
+    int n_steps = (max_shard + batch - 1) / batch;
+    float *own = ring->grads != NULL ? &ring->grads[(size_t) ring->rank * ring->n_params] : NULL;
+    float *grad = own != NULL ? own : allocate_float_1d(ring->n_params);
+    int status = 0;
+
+    for (int epoch = 0; epoch < n_epoch && status == 0; ++epoch) {
+        DistTotals t = {0, 0};
+        /* Every process makes the same number of steps, a short shard adds zeros at the end */
+        for (int step = 0; step < n_steps && status == 0; ++step) {
+            fill_zero(grad, ring->n_params);
+            int first = from + step * batch;
+            int last = first + batch < to ? first + batch : to;
+            for (int i = first; i < last; ++i) {
+                feed_forward_net(ann, X[i]);
+                if (predict_class(ann) == (int) y[i][0])
+                    t.correct++;
+                t.loss += fmaxf(accumulate_gradient(ann, X[i], y[i], grad), 0);
+            }
+
+            status = ring_allreduce(ring, grad);
+            /* The summed gradient is averaged over the processes */
+            if (status == 0)
+                apply_gradient(ann, grad, 1.0f / (float) ring->n);
+        }
+
+        if (status == 0)
+            status = reduce_totals(ring, &t);
+        if (status == 0 && ring->rank == 0) {
+            J[epoch] = (float) t.loss;
+            acc[epoch] = (float) t.correct / (float) dim.h;
+            if (epoch % 50 == 0)
+                printf("Epoch: %d   Error: %0.3f   Accuracy: %0.3f\n", epoch, J[epoch], acc[epoch]);
+        }
+    }
+
+    if (own == NULL)
+        free_float_1d(grad);
+    /* The others stop waiting at the barrier for this process */
+    if (status != 0 && ring->transport == DIST_SHM)
+        __atomic_store_n(&ring->shared->abort, 1, __ATOMIC_RELEASE);
+    return status;
+}
+
+
+/* Data-parallel training of ann on n_workers processes (the caller is one of them). Every step
+ * each process feeds batch samples of its shard, the gradients are summed by a ring all-reduce
+ * over transport and their average is applied everywhere. J and acc get the error and the
+ * accuracy of every epoch. Returns 0 on success and -1 for an empty dataset or if a worker failed
+ * or died, in which case the others stop too. */
+int train_net_distributed(NeuralNet *ann, float **X, float **y, Dim dim, int n_epoch, int n_workers,
+                          int batch, DistTransport transport, float *J, float *acc) {
+    if (dim.h < 1)
+        return -1;
+    if (n_workers < 1)
+        n_workers = 1;
+    if (n_workers > dim.h)
+        n_workers = dim.h;
+    if (batch < 1)
+        batch = 1;
+
+    DistRing ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.n = n_workers;
+    ring.n_params = net_param_count(ann);
+    ring.transport = transport;
+    ring.left_fd = ring.right_fd = -1;
+    ring.parent = getpid();
+
+    /* The segment is mapped before the fork, so every process sees the same pages */
+    size_t shared_size = sizeof(DistShared) + sizeof(DistTotals) * (size_t) n_workers;
+    shared_size = (shared_size + 63) / 64 * 64;
+    size_t map_size = shared_size;
+    if (transport == DIST_SHM)
+        map_size += sizeof(float) * (size_t) n_workers * (size_t) ring.n_params;
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    ring.shared = (DistShared*) map; /* zeroed by mmap */
+    if (transport == DIST_SHM)
+        ring.grads = (float*) ((char*) map + shared_size);
+
+    /* pair[i] connects process i (its right side) to process i + 1 (its left side) */
+    int (*pairs)[2] = (int (*)[2]) tann_alloc(sizeof(int[2]) * (size_t) n_workers);
+    for (int i = 0; i < n_workers; ++i)
+        pairs[i][0] = pairs[i][1] = -1;
+    int status = 0;
+    if (transport == DIST_SOCKET && n_workers > 1) {
+        ring.recv = allocate_float_1d(ring.n_params / n_workers + 1);
+        for (int i = 0; i < n_workers && status == 0; ++i)
+            status = socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]);
+        for (int i = 0; i < n_workers && status == 0; ++i) {
+            fcntl(pairs[i][0], F_SETFL, fcntl(pairs[i][0], F_GETFL) | O_NONBLOCK);
+            fcntl(pairs[i][1], F_SETFL, fcntl(pairs[i][1], F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    pid_t *pids = (pid_t*) tann_calloc((size_t) n_workers, sizeof(pid_t));
+    ring.pids = pids;
+    fflush(stdout);
+    for (int r = 1; r < n_workers && status == 0; ++r) {
+        pids[r] = fork();
+        if (pids[r] < 0) {
+            status = -1;
+        } else if (pids[r] == 0) {
+            ring.rank = r;
+            break;
+        }
+    }
+
+    if (status != 0 && ring.rank == 0) {
+        /* Workers that are already running would wait in the ring forever */
+        for (int r = 1; r < n_workers; ++r)
+            if (pids[r] > 0)
+                kill(pids[r], SIGKILL);
+        for (int i = 0; i < n_workers; ++i) {
+            if (pairs[i][0] >= 0)
+                close(pairs[i][0]);
+            if (pairs[i][1] >= 0)
+                close(pairs[i][1]);
+        }
+    } else {
+        if (transport == DIST_SOCKET && n_workers > 1) {
+            ring.right_fd = pairs[ring.rank][0];
+            ring.left_fd = pairs[(ring.rank + n_workers - 1) % n_workers][1];
+            for (int i = 0; i < n_workers; ++i) {
+                if (pairs[i][0] != ring.right_fd)
+                    close(pairs[i][0]);
+                if (pairs[i][1] != ring.left_fd)
+                    close(pairs[i][1]);
+            }
+        }
+        status = run_worker(&ring, ann, X, y, dim, n_epoch, batch, J, acc);
+        if (ring.rank != 0) {
+            fflush(stdout);
+            _exit(status == 0 ? 0 : 1);
+        }
+    }
+
+    if (ring.left_fd >= 0)
+        close(ring.left_fd);
+    if (ring.right_fd >= 0)
+        close(ring.right_fd);
+    for (int r = 1; r < n_workers; ++r) {
+        int ws;
+        if (pids[r] > 0 && (waitpid(pids[r], &ws, 0) < 0 || !WIFEXITED(ws) || WEXITSTATUS(ws) != 0))
+            status = -1;
+    }
+
+    munmap(map, map_size);
+    free_float_1d(ring.recv);
+    tann_free(pairs);
+    tann_free(pids);
+    return status;
+}
@@ -0,0 +1,213 @@
+/*
+ * This file contains the ensemble trainer. K two layer networks of the
+ * same shape are stored interleaved (struct of arrays): the weights of
+ * the K models sit next to each other, so the innermost loop of every
+ * kernel runs over the models and a single vector instruction advances
+ * several of them on the same sample. Useful for seed and hidden size
+ * sweeps over small networks, which can't fill the SIMD units alone.
+ *
+ */
+
+#include "perceptron.h"
+
+
+/* Creates K two layer nets, hidden_sizes and seeds may be NULL. The models have a single
+ * sigmoid output, returns NULL unless out is {in.w, 1}, k >= 1 and every hidden size >= 1. */
+Ensemble *create_ensemble(Dim in, Dim out, int k, const int *hidden_sizes, const unsigned int *seeds) {
+    if (out.h != in.w || out.w != 1 || k < 1)
+        return NULL;
+    if (hidden_sizes != NULL)
+        for (int m = 0; m < k; ++m)
+            if (hidden_sizes[m] < 1)
+                return NULL;
+
+    Ensemble *ens = (Ensemble*) tann_alloc(sizeof(Ensemble));
+    int n_in = in.h, n_hid = in.w;
+    ens->k = k;
+    ens->n_in = n_in;
+    ens->n_hidden = n_hid;
+    ens->hidden_sizes = (int*) tann_alloc(sizeof(int) * k);
+    ens->w1 = allocate_float_1d(n_in * n_hid * k);
+    ens->w2 = allocate_float_1d(n_hid * k);
+    ens->mask = allocate_float_1d(n_hid * k);
+    ens->hidden = allocate_float_1d(n_hid * k);
+    ens->delta_hidden = allocate_float_1d(n_hid * k);
+    ens->out = allocate_float_1d(k);
+    ens->delta_out = allocate_float_1d(k);
+    fill_zero(ens->w1, n_in * n_hid * k);
+    fill_zero(ens->w2, n_hid * k);
+
+    for (int m = 0; m < k; ++m) {
+        int size = hidden_sizes != NULL ? hidden_sizes[m] : n_hid;
+        if (size > n_hid)
+            size = n_hid;
+        ens->hidden_sizes[m] = size;
+
+        /* Drawn in the same order as create_net, so a lane matches a net made after tann_seed(seed) */
+        tann_rng rng;
+        if (seeds != NULL)
+            tann_rng_seed(&rng, seeds[m], 0);
+        else
+            tann_rng_seed(&rng, tann_rand(), 0);
+        for (int j = 0; j < n_in; ++j)
+            for (int h = 0; h < size; ++h)
+                ens->w1[(j * n_hid + h) * k + m] = tann_rng_float(&rng) - (float) 0.5;
+        for (int h = 0; h < size; ++h)
+            ens->w2[h * k + m] = tann_rng_float(&rng) - (float) 0.5;
+        for (int h = 0; h < n_hid; ++h)
+            ens->mask[h * k + m] = h < size ? 1 : 0;
+    }
+
+    return ens;
+}
+
+
+/* Free function for an ensemble */
+void free_ensemble(Ensemble *ens) {
+    tann_free(ens->hidden_sizes);
+    free_float_1d(ens->w1);
+    free_float_1d(ens->w2);
+    free_float_1d(ens->mask);
+    free_float_1d(ens->hidden);
+    free_float_1d(ens->delta_hidden);
+    free_float_1d(ens->out);
+    free_float_1d(ens->delta_out);
+    tann_free(ens);
+}
+
+
+/* Feeds forward one sample through every model */
+void feed_forward_ensemble(Ensemble *ens, const float *X) {
+    int k = ens->k, n_hid = ens->n_hidden;
+    float *hidden = ens->hidden;
+
+    fill_zero(hidden, n_hid * k);
+    for (int j = 0; j < ens->n_in; ++j) {
+        float xj = X[j];
+        const float *w = &ens->w1[j * n_hid * k];
+        for (int i = 0; i < n_hid * k; ++i)
+            hidden[i] += xj * w[i];
+    }
+    for (int i = 0; i < n_hid * k; ++i)
+        hidden[i] = sigmoid(hidden[i]) * ens->mask[i];
+
+    fill_zero(ens->out, k);
+    for (int h = 0; h < n_hid; ++h) {
+        const float *w = &ens->w2[h * k];
+        const float *a = &hidden[h * k];
+        for (int m = 0; m < k; ++m)
+            ens->out[m] += a[m] * w[m];
+    }
+    for (int m = 0; m < k; ++m)
+        ens->out[m] = sigmoid(ens->out[m]);
+}
+
+
+/* Makes one gradient step on a single sample with every model, same rule as train_net */
+static void train_ensemble_sample(Ensemble *ens, const float *X, float y, float *sum_err, int *correct) {
+    int k = ens->k, n_hid = ens->n_hidden;
+
+    for (int m = 0; m < k; ++m) {
+        float err = y - ens->out[m];
+        ens->delta_out[m] = err * ens->out[m] * (1 - ens->out[m]);
+        sum_err[m] += err * err * (float) 0.5;
+        correct[m] += (int) (ens->out[m] + 0.5) == (int) y;
+    }
+
+    for (int h = 0; h < n_hid; ++h) {
+        const float *w = &ens->w2[h * k];
+        const float *a = &ens->hidden[h * k];
+        float *d = &ens->delta_hidden[h * k];
+        for (int m = 0; m < k; ++m)
+            d[m] = w[m] * ens->delta_out[m] * a[m] * (1 - a[m]);
+    }
+
+    for (int h = 0; h < n_hid; ++h) {
+        float *w = &ens->w2[h * k];
+        const float *a = &ens->hidden[h * k];
+        for (int m = 0; m < k; ++m)
+            w[m] += ens->delta_out[m] * a[m];
+    }
+
+    for (int j = 0; j < ens->n_in; ++j) {
+        float xj = X[j];
+        float *w = &ens->w1[j * n_hid * k];
+        for (int i = 0; i < n_hid * k; ++i)
+            w[i] += xj * ens->delta_hidden[i];
+    }
+}
+
+
+/* Trains every model of the ensemble, J and acc are k x n_epoch matrices or NULL */
+void train_ensemble(Ensemble *ens, float **X, float **y, Dim dim, int n_epoch, float **J, float **acc) {
+    int k = ens->k;
+    float *sum_err = allocate_float_1d(k);
+    int *correct = (int*) tann_alloc(sizeof(int) * k);
+    tann_stats *stats = tann_stats_active();
+    double start = wall_time();
+
+    for (int step = 0; step < n_epoch; ++step) {
+        fill_zero(sum_err, k);
+        memset(correct, 0, sizeof(int) * k);
+
+        for (int i = 0; i < dim.h; ++i) {
+            feed_forward_ensemble(ens, X[i]);
+            train_ensemble_sample(ens, X[i], y[i][0], sum_err, correct);
+        }
+
+        float best = 0;
+        for (int m = 0; m < k; ++m) {
+            float a = (float) correct[m] / (float) dim.h;
+            if (J != NULL)
+                J[m][step] = sum_err[m];
+            if (acc != NULL)
+                acc[m][step] = a;
+            if (a > best)
+                best = a;
+        }
+
+        if (stats != NULL) {
+            stats->samples += (long) dim.h * k;
+            stats->epochs++;
+        }
+
+        if (step % 50 == 0)
+            printf("Epoch: %d   Models: %d   Best accuracy: %0.3f\n", step, k, best);
+    }
+
+    float training_time = (float) (wall_time() - start);
+    if (stats != NULL)
+        stats->train_sec += training_time;
+    printf("Training %d models took: %0.3f sec\n", k, training_time);
+
+    free_float_1d(sum_err);
+    tann_free(correct);
+}
+
+
+/* Copies one model of the ensemble into a standalone neural net */
+NeuralNet *ensemble_get_net(Ensemble *ens, int m) {
+    int k = ens->k, n_hid = ens->n_hidden, size = ens->hidden_sizes[m];
+    Dim in = {ens->n_in, size};
+    Dim out = {size, 1};
+    NeuralNet *ann = create_net(in, out);
+
+    for (int j = 0; j < ens->n_in; ++j)
+        for (int h = 0; h < size; ++h)
+            ann->input->weights[j][h] = ens->w1[(j * n_hid + h) * k + m];
+    for (int h = 0; h < size; ++h)
+        ann->output->weights[h][0] = ens->w2[h * k + m];
+    net_changed(ann);
+
+    return ann;
+}
+
+
+/* Evaluates every model of the ensemble, res has one entry per model */
+void test_ensemble(Ensemble *ens, float **X, float **y, Dim dim, int n_threads, EvalResult *res) {
+    for (int m = 0; m < ens->k; ++m) {
+        NeuralNet *ann = ensemble_get_net(ens, m);
+        eval_net(ann, X, y, dim, n_threads, &res[m]);
+        free_net(ann);
+    }
+}
@@ -0,0 +1,165 @@
+/*
+ * This file contains the evaluation engine of the library. The samples
+ * are split between threads, every thread scores its own rows in blocks
+ * of EVAL_BLOCK with feed_forward_batch_static on private buffers
+ * allocated once, so the threads share the network and every weight row
+ * is read once per block instead of once per sample. The partial metrics
+ * are merged at the end. Accuracy, RMSE,
+ * MAE, the confusion matrix and the ROC histograms are all collected in a
+ * single pass over the data.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include "perceptron.h"
+
+#define EVAL_BLOCK 64 /* rows scored by one batched forward pass */
+
+
+/* Work of a single evaluation thread */
+typedef struct EvalWorker {
+    NeuralNet *ann;
+    float **X, **y;
+    int from, to;
+    double sq_err, abs_err;
+    EvalResult res;
+} EvalWorker;
+
+
+/* Scores the rows of one worker */
+static void *eval_worker(void *arg) {
+    EvalWorker *w = (EvalWorker*) arg;
+    Layer *last = w->ann->output;
+    int softmax = last->act == ACT_SOFTMAX;
+
+    InferencePlan plan;
+    plan_inference(w->ann, &plan);
+    float *buf_a = allocate_float_1d(EVAL_BLOCK * plan.buf_a);
+    float *buf_b = allocate_float_1d(EVAL_BLOCK * plan.buf_b);
+    float **outs = allocate_float_2d(EVAL_BLOCK, plan.out_w);
+
+    for (int i = w->from; i < w->to; ++i) {
+        int r = (i - w->from) % EVAL_BLOCK;
+        if (r == 0) {
+            int n = w->to - i < EVAL_BLOCK ? w->to - i : EVAL_BLOCK;
+            feed_forward_batch_static(w->ann, &w->X[i], n, outs, buf_a, buf_b);
+        }
+        const float *out = outs[r];
+
+        int label = (int) w->y[i][0];
+        int pred = predict_class_from(w->ann, out);
+        if (pred == label)
+            w->res.correct++;
+        if (label >= 0 && label < TANN_MAX_CLASSES && pred >= 0 && pred < TANN_MAX_CLASSES)
+            w->res.confusion[label][pred]++;
+
+        /* A softmax net is scored on the probability of the true class */
+        float err, score;
+        if (softmax) {
+            err = label >= 0 && label < last->dim.w ? 1 - out[label] : 1;
+            score = last->dim.w > 1 ? out[1] : out[0];
+        } else {
+            err = w->y[i][0] - out[0];
+            score = out[0];
+        }
+        w->sq_err += err * err;
+        w->abs_err += fabs((double) err);
+
+        int bin = (int) (score * TANN_ROC_BINS);
+        if (bin < 0)
+            bin = 0;
+        if (bin >= TANN_ROC_BINS)
+            bin = TANN_ROC_BINS - 1;
+        if (label == 1)
+            w->res.roc_pos[bin]++;
+        else
+            w->res.roc_neg[bin]++;
+    }
+
+    free_float_1d(buf_a);
+    free_float_1d(buf_b);
+    free_float_2d(outs, EVAL_BLOCK);
+    return NULL;
+}
+
+
+/* Area under the ROC curve from the score histograms */
+static float roc_auc(const EvalResult *res) {
+    double pos = 0, neg = 0, area = 0;
+    for (int b = 0; b < TANN_ROC_BINS; ++b) {
+        pos += res->roc_pos[b];
+        neg += res->roc_neg[b];
+    }
+    if (pos == 0 || neg == 0)
+        return 0;
+
+    /* Sweeping the threshold down, ties inside a bin count as half */
+    double pos_above = 0;
+    for (int b = TANN_ROC_BINS - 1; b >= 0; --b) {
+        area += res->roc_neg[b] * (pos_above + 0.5 * res->roc_pos[b]);
+        pos_above += res->roc_pos[b];
+    }
+    return (float) (area / (pos * neg));
+}
+
+
+/* Evaluates a network on n_threads threads in a single pass */
+void eval_net(NeuralNet *ann, float **X, float **y, Dim dim, int n_threads, EvalResult *res) {
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > dim.h)
+        n_threads = dim.h > 0 ? dim.h : 1;
+
+    EvalWorker *workers = (EvalWorker*) tann_calloc(n_threads, sizeof(EvalWorker));
+    pthread_t *threads = (pthread_t*) tann_alloc(sizeof(pthread_t) * n_threads);
+
+    for (int t = 0; t < n_threads; ++t) {
+        workers[t].ann = ann;
+        workers[t].X = X;
+        workers[t].y = y;
+        workers[t].from = (int) ((long) dim.h * t / n_threads);
+        workers[t].to = (int) ((long) dim.h * (t + 1) / n_threads);
+    }
+
+    /* A slice whose thread can't be started is evaluated by the calling thread */
+    int *started = (int*) tann_calloc(n_threads, sizeof(int));
+    for (int t = 1; t < n_threads; ++t)
+        started[t] = pthread_create(&threads[t], NULL, eval_worker, &workers[t]) == 0;
+    for (int t = 0; t < n_threads; ++t)
+        if (!started[t])
+            eval_worker(&workers[t]);
+    for (int t = 1; t < n_threads; ++t)
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    tann_free(started);
+
+    /* Merging the partial results */
+    double sq_err = 0, abs_err = 0;
+    memset(res, 0, sizeof(EvalResult));
+    for (int t = 0; t < n_threads; ++t) {
+        EvalResult *part = &workers[t].res;
+        res->correct += part->correct;
+        for (int i = 0; i < TANN_MAX_CLASSES; ++i)
+            for (int j = 0; j < TANN_MAX_CLASSES; ++j)
+                res->confusion[i][j] += part->confusion[i][j];
+        for (int b = 0; b < TANN_ROC_BINS; ++b) {
+            res->roc_pos[b] += part->roc_pos[b];
+            res->roc_neg[b] += part->roc_neg[b];
+        }
+        sq_err += workers[t].sq_err;
+        abs_err += workers[t].abs_err;
+    }
+
+    res->n = dim.h;
+    res->n_classes = ann->output->act == ACT_SOFTMAX ? ann->output->dim.w : 2;
+    if (dim.h > 0) {
+        res->accuracy = (float) res->correct / (float) dim.h;
+        res->rmse = (float) sqrt(sq_err / dim.h);
+        res->mae = (float) (abs_err / dim.h);
+    }
+    res->auc = roc_auc(res);
+
+    tann_free(workers);
+    tann_free(threads);
+}
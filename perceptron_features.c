@@ -0,0 +1,117 @@
+/*
+ * This file contains the feature transform stage. A pipeline is a list
+ * of column operations (bias, copy, sin, product, square) declared once
+ * and applied to whole batches: the rows are processed in tiles, every
+ * input column of a tile is gathered into a contiguous array and each
+ * operation runs as one loop over the tile, which the compiler turns
+ * into SIMD code. The datasets, plot_trained_net and any serving code
+ * share the same pipeline, so an expansion is only written once.
+ *
+ */
+
+#include "perceptron.h"
+
+/* Rows processed together by feature_pipeline_apply */
+#define FEATURE_TILE 256
+
+
+/* Creates a pipeline, output column i is produced by ops[i] */
+FeaturePipeline *create_feature_pipeline(const FeatureOp *ops, int n_ops) {
+    FeaturePipeline *fp = (FeaturePipeline*) tann_alloc(sizeof(FeaturePipeline));
+    fp->n_ops = n_ops;
+    fp->ops = (FeatureOp*) tann_alloc(sizeof(FeatureOp) * n_ops);
+    memcpy(fp->ops, ops, sizeof(FeatureOp) * n_ops);
+
+    fp->in_w = 0;
+    for (int i = 0; i < n_ops; ++i) {
+        if (ops[i].kind != FEAT_BIAS && ops[i].a + 1 > fp->in_w)
+            fp->in_w = ops[i].a + 1;
+        if (ops[i].kind == FEAT_MUL && ops[i].b + 1 > fp->in_w)
+            fp->in_w = ops[i].b + 1;
+    }
+
+    return fp;
+}
+
+
+/* Free function for a pipeline */
+void free_feature_pipeline(FeaturePipeline *fp) {
+    tann_free(fp->ops);
+    tann_free(fp);
+}
+
+
+/* Expansion of the spiral example: [1, x, y] -> [1, x, y, sin(10x), sin(10y), xy, x^2, y^2] */
+FeaturePipeline *spiral_features() {
+    FeatureOp ops[8] = {
+        {FEAT_BIAS, 0, 0, 1},
+        {FEAT_COPY, 1, 0, 1},
+        {FEAT_COPY, 2, 0, 1},
+        {FEAT_SIN, 1, 0, 10},
+        {FEAT_SIN, 2, 0, 10},
+        {FEAT_MUL, 2, 1, 1},
+        {FEAT_SQUARE, 1, 0, 1},
+        {FEAT_SQUARE, 2, 0, 1}
+    };
+    return create_feature_pipeline(ops, 8);
+}
+
+
+/* Runs one operation over n gathered rows */
+static void apply_op(const FeatureOp *op, float **cols, float *dst, int n) {
+    const float *a = op->kind != FEAT_BIAS ? cols[op->a] : NULL;
+    const float *b = op->kind == FEAT_MUL ? cols[op->b] : NULL;
+    float scale = op->scale;
+
+    switch (op->kind) {
+        case FEAT_BIAS:
+            for (int i = 0; i < n; ++i)
+                dst[i] = scale;
+            break;
+        case FEAT_COPY:
+            for (int i = 0; i < n; ++i)
+                dst[i] = a[i] * scale;
+            break;
+        case FEAT_SIN:
+            for (int i = 0; i < n; ++i)
+                dst[i] = sinf(a[i] * scale);
+            break;
+        case FEAT_MUL:
+            for (int i = 0; i < n; ++i)
+                dst[i] = a[i] * b[i] * scale;
+            break;
+        case FEAT_SQUARE:
+            for (int i = 0; i < n; ++i)
+                dst[i] = a[i] * a[i] * scale;
+            break;
+    }
+}
+
+
+/* Transforms n rows, out[i] gets n_ops features computed from in[i]. in and out may be the same rows. */
+void feature_pipeline_apply(const FeaturePipeline *fp, float **in, float **out, int n) {
+    float *col_in = allocate_float_1d((fp->in_w > 0 ? fp->in_w : 1) * FEATURE_TILE);
+    float *col_out = allocate_float_1d(fp->n_ops * FEATURE_TILE);
+    float **cols = (float**) tann_alloc(sizeof(float*) * (fp->in_w > 0 ? fp->in_w : 1));
+    for (int j = 0; j < fp->in_w; ++j)
+        cols[j] = &col_in[j * FEATURE_TILE];
+
+    for (int from = 0; from < n; from += FEATURE_TILE) {
+        int count = n - from < FEATURE_TILE ? n - from : FEATURE_TILE;
+
+        for (int j = 0; j < fp->in_w; ++j)
+            for (int i = 0; i < count; ++i)
+                cols[j][i] = in[from + i][j];
+
+        for (int k = 0; k < fp->n_ops; ++k)
+            apply_op(&fp->ops[k], cols, &col_out[k * FEATURE_TILE], count);
+
+        for (int i = 0; i < count; ++i)
+            for (int k = 0; k < fp->n_ops; ++k)
+                out[from + i][k] = col_out[k * FEATURE_TILE + i];
+    }
+
+    tann_free(cols);
+    free_float_1d(col_in);
+    free_float_1d(col_out);
+}
@@ -0,0 +1,464 @@
+/*
+ * This file contains the fixed-point numeric mode of the library for
+ * microcontrollers without an FPU. quantize_net turns a trained net into
+ * a QNet: the weights become 16 bit (Q15) or 8 bit (Q7) integers and the
+ * activations 16 bit integers, each with a power of two scale chosen per
+ * layer from the largest weight and, for unbounded activations, from the
+ * largest output seen on calibration samples. The dot products are summed
+ * in 32 bits with saturation, sigmoid, tanh and softmax interpolate in
+ * lookup tables, so inference and on-device training need no float at
+ * all. qnet_validate compares a QNet with the float net it came from.
+ *
+ * Every product and shift is done in int32_t or int64_t, so the kernels
+ * also hold where int is 16 bits wide, like on AVR.
+ *
+ */
+
+#include "perceptron.h"
+
+/* Fractional bits of the weighted inputs fed to the lookup tables and of the training deltas */
+#define Q_FRAC 12
+
+/* Fractional bits assumed for inputs and unbounded outputs without calibration samples */
+#define Q_DEFAULT_FRAC 8
+
+/* Most fractional bits kept in the int32 accumulators, leaves them a range of +-128 */
+#define Q_ACC_FRAC 24
+
+/* Q15 weights may grow this many times larger than the largest one during training */
+#define Q_WEIGHT_HEADROOM 16
+
+/* TANN_LEAKY_SLOPE in Q_FRAC */
+#define Q_LEAKY_SLOPE 41
+
+
+/* Logistic function 1 / (1 + e^-u) in Q15 for u = -8, -8 + 1/16, ..., 8 */
+static const int16_t logistic_lut[257] = {
+    11, 12, 12, 13, 14, 15, 16, 17, 18, 19, 21, 22,
+    23, 25, 26, 28, 30, 32, 34, 36, 38, 41, 43, 46,
+    49, 52, 56, 59, 63, 67, 72, 76, 81, 86, 92, 98,
+    104, 111, 118, 125, 133, 142, 151, 161, 171, 182, 194, 206,
+    219, 233, 248, 264, 281, 299, 318, 338, 360, 383, 407, 433,
+    461, 490, 521, 554, 589, 627, 666, 708, 753, 800, 851, 904,
+    961, 1021, 1084, 1152, 1223, 1299, 1379, 1464, 1554, 1649, 1750, 1856,
+    1969, 2088, 2213, 2346, 2486, 2633, 2789, 2952, 3124, 3306, 3496, 3696,
+    3906, 4126, 4357, 4599, 4851, 5115, 5391, 5678, 5978, 6289, 6613, 6949,
+    7297, 7658, 8031, 8416, 8813, 9221, 9641, 10072, 10513, 10964, 11424, 11894,
+    12371, 12856, 13348, 13845, 14347, 14852, 15361, 15872, 16384, 16896, 17407, 17916,
+    18421, 18923, 19420, 19912, 20397, 20874, 21344, 21804, 22255, 22696, 23127, 23547,
+    23955, 24352, 24737, 25110, 25471, 25819, 26155, 26479, 26790, 27090, 27377, 27653,
+    27917, 28169, 28411, 28642, 28862, 29072, 29272, 29462, 29644, 29816, 29979, 30135,
+    30282, 30422, 30555, 30680, 30799, 30912, 31018, 31119, 31214, 31304, 31389, 31469,
+    31545, 31616, 31684, 31747, 31807, 31864, 31917, 31968, 32015, 32060, 32102, 32141,
+    32179, 32214, 32247, 32278, 32307, 32335, 32361, 32385, 32408, 32430, 32450, 32469,
+    32487, 32504, 32520, 32535, 32549, 32562, 32574, 32586, 32597, 32607, 32617, 32626,
+    32635, 32643, 32650, 32657, 32664, 32670, 32676, 32682, 32687, 32692, 32696, 32701,
+    32705, 32709, 32712, 32716, 32719, 32722, 32725, 32727, 32730, 32732, 32734, 32736,
+    32738, 32740, 32742, 32743, 32745, 32746, 32747, 32749, 32750, 32751, 32752, 32753,
+    32754, 32755, 32756, 32756, 32757
+};
+
+
+/* e^-d in Q15 for d = 0, 1/16, ..., 16 */
+static const int16_t exp_lut[257] = {
+    32767, 30783, 28918, 27166, 25520, 23974, 22521, 21157, 19875, 18671, 17539, 16477,
+    15479, 14541, 13660, 12832, 12055, 11324, 10638, 9994, 9388, 8819, 8285, 7783,
+    7312, 6869, 6452, 6061, 5694, 5349, 5025, 4721, 4435, 4166, 3914, 3676,
+    3454, 3244, 3048, 2863, 2690, 2527, 2374, 2230, 2095, 1968, 1849, 1737,
+    1631, 1533, 1440, 1352, 1271, 1194, 1121, 1053, 990, 930, 873, 820,
+    771, 724, 680, 639, 600, 564, 530, 498, 467, 439, 412, 387,
+    364, 342, 321, 302, 283, 266, 250, 235, 221, 207, 195, 183,
+    172, 162, 152, 143, 134, 126, 118, 111, 104, 98, 92, 86,
+    81, 76, 72, 67, 63, 59, 56, 52, 49, 46, 43, 41,
+    38, 36, 34, 32, 30, 28, 26, 25, 23, 22, 21, 19,
+    18, 17, 16, 15, 14, 13, 12, 12, 11, 10, 10, 9,
+    9, 8, 8, 7, 7, 6, 6, 6, 5, 5, 5, 4,
+    4, 4, 4, 3, 3, 3, 3, 3, 2, 2, 2, 2,
+    2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0
+};
+
+
+static int16_t sat16(int32_t v) {
+    return (int16_t) (v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v));
+}
+
+
+/* a + b clamped to the int32_t range */
+static int32_t sat_add32(int32_t a, int32_t b) {
+    int32_t s = (int32_t) ((uint32_t) a + (uint32_t) b);
+    if (((a ^ s) & (b ^ s)) < 0)
+        s = a < 0 ? INT32_MIN : INT32_MAX;
+    return s;
+}
+
+
+/* Moves v from from fractional bits to to fractional bits, rounding and saturating */
+static int32_t requantize(int32_t v, int from, int to) {
+    int s = from - to;
+    if (s > 0)
+        return (int32_t) (((int64_t) v + ((int64_t) 1 << (s - 1))) >> s);
+    int64_t r = (int64_t) v * ((int64_t) 1 << -s);
+    return (int32_t) (r > INT32_MAX ? INT32_MAX : (r < INT32_MIN ? INT32_MIN : r));
+}
+
+
+/* Interpolates a table of 257 entries at x / 16 - offset, x in Q_FRAC */
+static int32_t lookup(const int16_t *lut, int32_t x, int32_t offset) {
+    int32_t pos = sat_add32(x, offset << Q_FRAC);
+    if (pos <= 0)
+        return lut[0];
+    int32_t idx = pos >> (Q_FRAC - 4), frac = pos & ((1 << (Q_FRAC - 4)) - 1);
+    if (idx >= 256)
+        return lut[256];
+    return lut[idx] + (((int32_t) (lut[idx + 1] - lut[idx]) * frac) >> (Q_FRAC - 4));
+}
+
+
+/* Largest number of fractional bits (at most 15) that keeps max_abs within limit */
+static int frac_for(float max_abs, int limit) {
+    int f = 15;
+    while (f > 0 && max_abs * (float) ((int32_t) 1 << f) > (float) limit)
+        --f;
+    return f;
+}
+
+
+static int bounded(Activation act) {
+    return act == ACT_SIGMOID || act == ACT_SOFTMAX || act == ACT_TANH;
+}
+
+
+/* Quantizes a trained net. The scales of the inputs and of the outputs of relu, leaky relu and
+ * linear layers come from running the float net on the n calibration samples in X, which may be
+ * NULL. Q7 nets can't be trained on the device. */
+QNet *quantize_net(NeuralNet *ann, QFormat fmt, float **X, int n) {
+    QNet *q = (QNet*) tann_calloc(1, sizeof(QNet));
+    q->fmt = fmt;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+        q->n_layers++;
+    q->layers = (QLayer*) tann_calloc((size_t) q->n_layers, sizeof(QLayer));
+
+    /* Largest input and outputs of the calibration samples */
+    float in_max = 0, out_max[TANN_MAX_LAYERS] = {0};
+    for (int i = 0; X != NULL && i < n; ++i) {
+        feed_forward_net(ann, X[i]);
+        for (int j = 0; j < ann->input->dim.h; ++j)
+            in_max = fmaxf(in_max, fabsf(X[i][j]));
+        int l = 0;
+        for (Layer *iter = ann->input; iter != NULL && l < TANN_MAX_LAYERS; iter = iter->next, ++l)
+            for (int k = 0; k < iter->dim.w; ++k)
+                out_max[l] = fmaxf(out_max[l], fabsf(iter->out[k]));
+    }
+    q->in_frac = X != NULL && n > 0 ? frac_for(in_max, INT16_MAX) : Q_DEFAULT_FRAC;
+
+    int l = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next, ++l) {
+        QLayer *ql = &q->layers[l];
+        int size = iter->dim.h * iter->dim.w;
+        ql->dim = iter->dim;
+        ql->act = iter->act;
+
+        float w_max = 0;
+        for (int i = 0; i < iter->dim.h; ++i)
+            for (int j = 0; j < iter->dim.w; ++j)
+                w_max = fmaxf(w_max, fabsf(iter->weights[i][j]));
+        if (fmt == Q7)
+            ql->w_frac = frac_for(w_max, INT8_MAX);
+        else
+            ql->w_frac = frac_for(w_max * Q_WEIGHT_HEADROOM, INT16_MAX);
+
+        if (fmt == Q7)
+            ql->w8 = (int8_t*) tann_alloc(sizeof(int8_t) * (size_t) size);
+        else
+            ql->w = (int16_t*) tann_alloc(sizeof(int16_t) * (size_t) size);
+        for (int i = 0; i < iter->dim.h; ++i) {
+            for (int j = 0; j < iter->dim.w; ++j) {
+                int32_t v = (int32_t) lroundf(iter->weights[i][j] * (float) ((int32_t) 1 << ql->w_frac));
+                if (fmt == Q7)
+                    ql->w8[i * iter->dim.w + j] = (int8_t) (v > INT8_MAX ? INT8_MAX : (v < INT8_MIN ? INT8_MIN : v));
+                else
+                    ql->w[i * iter->dim.w + j] = sat16(v);
+            }
+        }
+
+        if (bounded(iter->act))
+            ql->out_frac = 15;
+        else if (X != NULL && n > 0 && l < TANN_MAX_LAYERS)
+            ql->out_frac = frac_for(out_max[l], INT16_MAX);
+        else
+            ql->out_frac = Q_DEFAULT_FRAC;
+
+        ql->out = (int16_t*) tann_calloc((size_t) iter->dim.w, sizeof(int16_t));
+        ql->delta = (int16_t*) tann_calloc((size_t) iter->dim.w, sizeof(int16_t));
+        ql->acc = (int32_t*) tann_calloc((size_t) iter->dim.w, sizeof(int32_t));
+    }
+    return q;
+}
+
+
+void free_qnet(QNet *q) {
+    for (int l = 0; l < q->n_layers; ++l) {
+        tann_free(q->layers[l].w);
+        tann_free(q->layers[l].w8);
+        tann_free(q->layers[l].out);
+        tann_free(q->layers[l].delta);
+        tann_free(q->layers[l].acc);
+    }
+    tann_free(q->layers);
+    tann_free(q);
+}
+
+
+/* Converts a float sample into the input format of the net */
+void qnet_quantize_input(const QNet *q, const float *x, int16_t *qx) {
+    for (int j = 0; j < q->layers[0].dim.h; ++j)
+        qx[j] = sat16((int32_t) lroundf(x[j] * (float) ((int32_t) 1 << q->in_frac)));
+}
+
+
+/* Applies the activation of a layer on its weighted inputs in zf fractional bits */
+static void qactivate(QLayer *ql, int zf) {
+    int n = ql->dim.w;
+    if (ql->act == ACT_SOFTMAX) {
+        int32_t max = INT32_MIN, sum = 0;
+        for (int k = 0; k < n; ++k) {
+            ql->acc[k] = requantize(ql->acc[k], zf, Q_FRAC);
+            if (ql->acc[k] > max)
+                max = ql->acc[k];
+        }
+        /* e^(z - max) is at most 1, so the sum of the n terms fits easily */
+        for (int k = 0; k < n; ++k) {
+            ql->acc[k] = lookup(exp_lut, max - ql->acc[k], 0);
+            sum += ql->acc[k];
+        }
+        for (int k = 0; k < n; ++k)
+            ql->out[k] = sat16(sum > 0 ? (ql->acc[k] << 15) / sum : 0);
+        return;
+    }
+
+    for (int k = 0; k < n; ++k) {
+        int32_t z = requantize(ql->acc[k], zf, Q_FRAC);
+        switch (ql->act) {
+            case ACT_TANH:
+                ql->out[k] = sat16(2 * lookup(logistic_lut, sat_add32(z, z), 8) - 32768);
+                break;
+            case ACT_RELU:
+                ql->out[k] = sat16(requantize(z > 0 ? z : 0, Q_FRAC, ql->out_frac));
+                break;
+            case ACT_LEAKY_RELU:
+                if (z < 0)
+                    z = (int32_t) (((int64_t) z * Q_LEAKY_SLOPE) >> Q_FRAC);
+                ql->out[k] = sat16(requantize(z, Q_FRAC, ql->out_frac));
+                break;
+            case ACT_LINEAR:
+                ql->out[k] = sat16(requantize(z, Q_FRAC, ql->out_frac));
+                break;
+            default:
+                /* sigmoid(x) is the logistic function of x - 0.5 */
+                ql->out[k] = sat16(lookup(logistic_lut, sat_add32(z, -(1 << (Q_FRAC - 1))), 8));
+                break;
+        }
+    }
+}
+
+
+/* Feeds forward a quantized sample, returns the outputs of the net in the out_frac of the last layer */
+const int16_t *qnet_forward(QNet *q, const int16_t *x) {
+    const int16_t *in = x;
+    int in_frac = q->in_frac;
+    for (int l = 0; l < q->n_layers; ++l) {
+        QLayer *ql = &q->layers[l];
+        int w = ql->dim.w, zf = in_frac + ql->w_frac;
+        int shift = zf > Q_ACC_FRAC ? zf - Q_ACC_FRAC : 0;
+        memset(ql->acc, 0, sizeof(int32_t) * (size_t) w);
+        for (int j = 0; j < ql->dim.h; ++j) {
+            int32_t xj = in[j];
+            if (xj == 0)
+                continue;
+            if (ql->w8 != NULL) {
+                const int8_t *row = &ql->w8[j * w];
+                for (int k = 0; k < w; ++k)
+                    ql->acc[k] = sat_add32(ql->acc[k], (xj * row[k]) >> shift);
+            } else {
+                const int16_t *row = &ql->w[j * w];
+                for (int k = 0; k < w; ++k)
+                    ql->acc[k] = sat_add32(ql->acc[k], (xj * row[k]) >> shift);
+            }
+        }
+        qactivate(ql, zf - shift);
+        in = ql->out;
+        in_frac = ql->out_frac;
+    }
+    return q->layers[q->n_layers - 1].out;
+}
+
+
+/* Converts the outputs of the last qnet_forward to float */
+void qnet_output(const QNet *q, float *out) {
+    const QLayer *ql = &q->layers[q->n_layers - 1];
+    for (int k = 0; k < ql->dim.w; ++k)
+        out[k] = (float) ql->out[k] / (float) ((int32_t) 1 << ql->out_frac);
+}
+
+
+/* Class predicted by the last qnet_forward, the same rule as predict_class */
+int qnet_predict_class(const QNet *q) {
+    const QLayer *ql = &q->layers[q->n_layers - 1];
+    if (ql->act != ACT_SOFTMAX)
+        return requantize(ql->out[0], ql->out_frac, 0);
+
+    int best = 0;
+    for (int k = 1; k < ql->dim.w; ++k)
+        if (ql->out[k] > ql->out[best])
+            best = k;
+    return best;
+}
+
+
+/* Derivative of the activation at output o, in Q15 */
+static int32_t qderivative(const QLayer *ql, int32_t o) {
+    switch (ql->act) {
+        case ACT_TANH:
+            return 32767 - ((o * o) >> 15);
+        case ACT_RELU:
+            return o > 0 ? 32767 : 0;
+        case ACT_LEAKY_RELU:
+            return o > 0 ? 32767 : (Q_LEAKY_SLOPE << (15 - Q_FRAC));
+        case ACT_LINEAR:
+        case ACT_SOFTMAX:
+            return 32767;
+        default:
+            return (o * (32768 - o)) >> 15;
+    }
+}
+
+
+/* Fractional bits of the training targets: Q_FRAC for bounded outputs, the calibrated range of
+ * the outputs otherwise, so a regression target is as large as the outputs may get */
+static int target_frac(const QLayer *out) {
+    return bounded(out->act) ? Q_FRAC : out->out_frac;
+}
+
+
+/* Converts a float label into the training target of qnet_train_sample: one value per output,
+ * one hot for a softmax output. Returns -1 if a softmax label is not one of the classes or a
+ * target is out of the range of the outputs. Meant to run once while the dataset is prepared,
+ * not on the device. */
+int qnet_quantize_target(const QNet *q, const float *y, int16_t *qy) {
+    const QLayer *out = &q->layers[q->n_layers - 1];
+    if (out->act == ACT_SOFTMAX) {
+        int label = (int) y[0];
+        if (label < 0 || label >= out->dim.w)
+            return -1;
+        for (int k = 0; k < out->dim.w; ++k)
+            qy[k] = (int16_t) (k == label ? (int32_t) 1 << Q_FRAC : 0);
+        return 0;
+    }
+
+    float scale = (float) ((int32_t) 1 << target_frac(out));
+    for (int k = 0; k < out->dim.w; ++k) {
+        float v = roundf(y[k] * scale);
+        if (!(v >= INT16_MIN && v <= INT16_MAX))
+            return -1;
+        qy[k] = (int16_t) v;
+    }
+    return 0;
+}
+
+
+/* One gradient step on the sample of the last qnet_forward, the same step as train_epoch
+ * makes in float. y is a target made by qnet_quantize_target, so the step needs no float.
+ * Returns -1 without a step for Q7 nets, whose weights are too coarse to be trained. */
+int qnet_train_sample(QNet *q, const int16_t *x, const int16_t *y) {
+    QLayer *out = &q->layers[q->n_layers - 1];
+    if (q->fmt == Q7)
+        return -1;
+
+    /* Output deltas in Q_FRAC */
+    for (int k = 0; k < out->dim.w; ++k) {
+        int32_t o = requantize(out->out[k], out->out_frac, Q_FRAC);
+        int32_t err = requantize(y[k], target_frac(out), Q_FRAC) - o;
+        if (out->act != ACT_SOFTMAX)
+            err = (int32_t) (((int64_t) err * qderivative(out, requantize(out->out[k], out->out_frac, 15))) >> 15);
+        out->delta[k] = sat16(err);
+    }
+
+    /* Hidden deltas, all of them with the old weights */
+    for (int l = q->n_layers - 2; l >= 0; --l) {
+        QLayer *ql = &q->layers[l], *next = &q->layers[l + 1];
+        int zf = next->w_frac + Q_FRAC;
+        int shift = zf > Q_ACC_FRAC ? zf - Q_ACC_FRAC : 0;
+        for (int j = 0; j < ql->dim.w; ++j) {
+            int32_t sum = 0;
+            const int16_t *row = &next->w[j * next->dim.w];
+            for (int k = 0; k < next->dim.w; ++k)
+                sum = sat_add32(sum, ((int32_t) row[k] * next->delta[k]) >> shift);
+            int32_t d = requantize(sum, zf - shift, Q_FRAC);
+            int32_t o = requantize(ql->out[j], ql->out_frac, 15);
+            ql->delta[j] = sat16((int32_t) (((int64_t) d * qderivative(ql, o)) >> 15));
+        }
+    }
+
+    /* Updates w += x * delta */
+    const int16_t *in = x;
+    int in_frac = q->in_frac;
+    for (int l = 0; l < q->n_layers; ++l) {
+        QLayer *ql = &q->layers[l];
+        int w = ql->dim.w;
+        for (int j = 0; j < ql->dim.h; ++j) {
+            int32_t xj = in[j];
+            if (xj == 0)
+                continue;
+            int16_t *row = &ql->w[j * w];
+            for (int k = 0; k < w; ++k)
+                row[k] = sat16(row[k] + requantize(xj * ql->delta[k], in_frac + Q_FRAC, ql->w_frac));
+        }
+        in = ql->out;
+        in_frac = ql->out_frac;
+    }
+    return 0;
+}
+
+
+/* Compares a QNet with the float net it was quantized from on a labelled dataset */
+void qnet_validate(QNet *q, NeuralNet *ann, float **X, float **y, Dim dim, QNetReport *rep) {
+    InferencePlan plan;
+    plan_inference(ann, &plan);
+    float *buf_a = allocate_float_1d(plan.buf_a), *buf_b = allocate_float_1d(plan.buf_b);
+    float *qout = allocate_float_1d(plan.out_w);
+    int16_t *qx = (int16_t*) tann_alloc(sizeof(int16_t) * (size_t) plan.in_w);
+    int float_correct = 0, fixed_correct = 0, agree = 0;
+
+    memset(rep, 0, sizeof(QNetReport));
+    for (int i = 0; i < dim.h; ++i) {
+        const float *out = infer_static(ann, X[i], buf_a, buf_b);
+        qnet_quantize_input(q, X[i], qx);
+        qnet_forward(q, qx);
+        qnet_output(q, qout);
+
+        int float_class = predict_class_from(ann, out), fixed_class = qnet_predict_class(q);
+        float_correct += float_class == (int) y[i][0];
+        fixed_correct += fixed_class == (int) y[i][0];
+        agree += float_class == fixed_class;
+        for (int k = 0; k < plan.out_w; ++k)
+            rep->max_abs_err = fmaxf(rep->max_abs_err, fabsf(out[k] - qout[k]));
+    }
+    if (dim.h > 0) {
+        rep->float_accuracy = (float) float_correct / (float) dim.h;
+        rep->fixed_accuracy = (float) fixed_correct / (float) dim.h;
+        rep->agreement = (float) agree / (float) dim.h;
+    }
+
+    free_float_1d(buf_a);
+    free_float_1d(buf_b);
+    free_float_1d(qout);
+    tann_free(qx);
+}
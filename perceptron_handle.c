@@ -0,0 +1,118 @@
+/*
+ * This file contains the model handle used to swap a net under running
+ * inference threads. It is a small read-copy-update scheme: readers find
+ * the current net through one atomic pointer and announce the epoch they
+ * entered in their own slot, so a read section is two atomic stores and
+ * two loads without any lock. model_publish swaps the pointer, starts a
+ * new epoch and waits until every reader that may still see the old net
+ * has left its read section, then frees the old net. Readers never wait
+ * for a publish.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sched.h>
+#include "perceptron.h"
+
+#define CACHE_LINE 64
+
+
+/* Epoch of a reader padded to a cache line, so readers don't share lines */
+typedef struct ReaderSlot {
+    unsigned long epoch; /* epoch the read section started in, 0 outside of it */
+    int used;
+    char pad[CACHE_LINE - sizeof(unsigned long) - sizeof(int)];
+} ReaderSlot;
+
+
+struct ModelHandle {
+    NeuralNet *current;
+    unsigned long epoch;
+    pthread_mutex_t publish_lock; /* one publisher at a time, readers never take it */
+    ReaderSlot *readers; /* TANN_MAX_READERS slots starting on a cache line */
+    void *readers_block; /* allocation the slots were aligned in */
+};
+
+
+/* Creates a handle that owns ann */
+ModelHandle *create_model_handle(NeuralNet *ann) {
+    ModelHandle *h = (ModelHandle*) tann_calloc(1, sizeof(ModelHandle));
+    /* tann_alloc only aligns to 16 bytes, the slots are moved up to the next line */
+    h->readers_block = tann_calloc(1, sizeof(ReaderSlot) * TANN_MAX_READERS + CACHE_LINE - 1);
+    uintptr_t addr = (uintptr_t) h->readers_block;
+    h->readers = (ReaderSlot*) ((addr + CACHE_LINE - 1) & ~(uintptr_t) (CACHE_LINE - 1));
+    h->current = ann;
+    h->epoch = 1;
+    pthread_mutex_init(&h->publish_lock, NULL);
+    return h;
+}
+
+
+/* Frees the handle and its current net, no reader may use it anymore */
+void free_model_handle(ModelHandle *h) {
+    if (h->current != NULL)
+        free_net(h->current);
+    pthread_mutex_destroy(&h->publish_lock);
+    tann_free(h->readers_block);
+    tann_free(h);
+}
+
+
+/* Takes a reader slot for the calling thread, returns -1 if all TANN_MAX_READERS are taken */
+int model_reader_register(ModelHandle *h) {
+    for (int r = 0; r < TANN_MAX_READERS; ++r) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&h->readers[r].used, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return r;
+    }
+    return -1;
+}
+
+
+/* Gives back a reader slot, it must be outside of a read section */
+void model_reader_unregister(ModelHandle *h, int reader) {
+    __atomic_store_n(&h->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->readers[reader].used, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Starts a read section and returns the current net. It stays valid until model_read_end,
+ * and may only be used through reentrant calls like infer_static or feed_forward_batch.
+ * The net may differ in shape from the one of the last read section, so the buffers of
+ * infer_static have to be checked against plan_inference every time. */
+NeuralNet *model_read_begin(ModelHandle *h, int reader) {
+    /* The epoch is announced before the pointer is loaded, so a publish that misses
+     * this reader has already swapped the pointer */
+    unsigned long epoch = __atomic_load_n(&h->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+}
+
+
+/* Ends a read section, the net of model_read_begin must not be used after it */
+void model_read_end(ModelHandle *h, int reader) {
+    __atomic_store_n(&h->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Makes ann the current net of the handle (which owns it from now on) and frees the previous
+ * one once every reader that could still see it has left its read section */
+void model_publish(ModelHandle *h, NeuralNet *ann) {
+    pthread_mutex_lock(&h->publish_lock);
+    NeuralNet *old = __atomic_exchange_n(&h->current, ann, __ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_fetch_add(&h->epoch, 1, __ATOMIC_SEQ_CST);
+
+    /* Readers that entered in a later epoch already see the new net */
+    for (int r = 0; r < TANN_MAX_READERS; ++r) {
+        ReaderSlot *slot = &h->readers[r];
+        unsigned long e;
+        while ((e = __atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST)) != 0 && e <= epoch)
+            sched_yield();
+    }
+    pthread_mutex_unlock(&h->publish_lock);
+
+    if (old != NULL)
+        free_net(old);
+}
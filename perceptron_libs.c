@@ -35,19 +35,76 @@ void print_net(NeuralNet *ann) {
 }
 
 
+/* Frees a layer without touching its neighbours */
+static void free_layer(Layer *layer) {
+    tann_free(layer->in);
+    tann_free(layer->out);
+    tann_free(layer->delta);
+    free_float_2d(layer->weights, layer->dim.h);
+    tann_free(layer);
+}
+
+
 /* Free function for the whole neural net */
 void free_net(NeuralNet *ann) {
     Layer *iter = ann->input;
     while (iter != NULL) {
         Layer *next = iter->next;
-        free(iter->in);
-        free(iter->out);
-        free_float_2d(iter->weights, iter->dim.h);
-        free(iter);
+        free_layer(iter);
         iter = next;
     }
 
-    free(ann);
+    tann_free(ann);
+}
+
+
+/* Creates a deep copy of a layer without linking it */
+static Layer *copy_layer(Layer *src) {
+    Layer *dst = (Layer*) tann_alloc(sizeof(Layer));
+    dst->dim = src->dim;
+    dst->act = src->act;
+    dst->in = allocate_float_1d(src->dim.w);
+    dst->out = allocate_float_1d(src->dim.w);
+    dst->delta = allocate_float_1d(src->dim.w);
+    dst->weights = allocate_float_2d(src->dim.h, src->dim.w);
+    memcpy(dst->in, src->in, sizeof(float) * src->dim.w);
+    memcpy(dst->out, src->out, sizeof(float) * src->dim.w);
+    fill_zero(dst->delta, src->dim.w);
+    for (int i = 0; i < src->dim.h; ++i)
+        memcpy(dst->weights[i], src->weights[i], sizeof(float) * src->dim.w);
+    dst->prev = NULL;
+    dst->next = NULL;
+    return dst;
+}
+
+
+/* Creates a deep copy of a neural net */
+NeuralNet *copy_net(NeuralNet *ann) {
+    NeuralNet *copy = (NeuralNet*) tann_alloc(sizeof(NeuralNet));
+    copy->input = copy_layer(ann->input);
+    copy->output = copy->input;
+    copy->version = ann->version;
+    copy->n_seen = ann->n_seen;
+    copy->running_loss = ann->running_loss;
+
+    for (Layer *iter = ann->input->next; iter != NULL; iter = iter->next) {
+        Layer *layer = copy_layer(iter);
+        layer->prev = copy->output;
+        copy->output->next = layer;
+        copy->output = layer;
+    }
+
+    return copy;
+}
+
+
+/* Version stamps are unique in the process, so equal versions always mean equal weights */
+static unsigned long last_version = 0;
+
+
+/* Gives the net a new version stamp, call it after changing the weights */
+void net_changed(NeuralNet *ann) {
+    ann->version = __atomic_add_fetch(&last_version, 1, __ATOMIC_RELAXED);
 }
 
 
@@ -61,170 +118,562 @@ void init_weight_matrix(float **w, Dim dim) {
 }
 
 
-/* Allocates memory and creates a neural net */
-NeuralNet *create_net(Dim in, Dim out) {
-    NeuralNet *ann = (NeuralNet*) malloc(sizeof(NeuralNet));
-    ann->input = (Layer*) malloc(sizeof(Layer));
-    ann->output = (Layer*) malloc(sizeof(Layer));
-    ann->input->prev = NULL;
+/* Allocates an unlinked layer with random weights */
+static Layer *create_layer(Dim dim, Activation act) {
+    Layer *layer = (Layer*) tann_alloc(sizeof(Layer));
+    layer->dim = dim;
+    layer->act = act;
+    layer->weights = allocate_float_2d(dim.h, dim.w);
+    layer->in = allocate_float_1d(dim.w);
+    layer->out = allocate_float_1d(dim.w);
+    layer->delta = allocate_float_1d(dim.w);
+    layer->prev = NULL;
+    layer->next = NULL;
+
+    init_weight_matrix(layer->weights, dim);
+    fill_zero(layer->in, dim.w);
+    fill_zero(layer->out, dim.w);
+    fill_zero(layer->delta, dim.w);
+    return layer;
+}
+
+
+/* Allocates memory and creates a neural net with the given activations */
+NeuralNet *create_net_act(Dim in, Dim out, Activation hidden, Activation output) {
+    NeuralNet *ann = (NeuralNet*) tann_alloc(sizeof(NeuralNet));
+    ann->input = create_layer(in, hidden);
+    ann->output = create_layer(out, output);
     ann->input->next = ann->output;
     ann->output->prev = ann->input;
-    ann->output->next = NULL;
+    ann->n_seen = 0;
+    ann->running_loss = 0;
+    net_changed(ann);
+    return ann;
+}
 
-    ann->input->dim.h = in.h;
-    ann->input->dim.w = in.w;
-    ann->output->dim.h = out.h;
-    ann->output->dim.w = out.w;
 
-    ann->input->weights = allocate_float_2d(ann->input->dim.h, ann->input->dim.w);
-    ann->output->weights = allocate_float_2d(ann->output->dim.h, ann->output->dim.w);
-    ann->input->in = allocate_float_1d(ann->input->dim.w + ann->input->dim.h);
-    ann->input->out = allocate_float_1d(ann->input->dim.w + ann->input->dim.h);
-    ann->output->in = allocate_float_1d(ann->output->dim.h);
-    ann->output->out = allocate_float_1d(ann->output->dim.h);
+/* Allocates memory and creates a neural net */
+NeuralNet *create_net(Dim in, Dim out) {
+    return create_net_act(in, out, ACT_SIGMOID, ACT_SIGMOID);
+}
 
-    init_weight_matrix(ann->input->weights, ann->input->dim);
-    init_weight_matrix(ann->output->weights, ann->output->dim);
 
-    fill_zero(ann->input->in, ann->input->dim.h);
-    fill_zero(ann->input->out, ann->input->dim.h);
-    fill_zero(ann->output->in, ann->output->dim.h);
-    fill_zero(ann->output->out, ann->output->dim.h);
+/* Creates a neural net with a softmax output layer, the labels are class indices */
+NeuralNet *create_softmax_net(Dim in, Dim out) {
+    return create_net_act(in, out, ACT_SIGMOID, ACT_SOFTMAX);
+}
 
-    return ann;
+
+/* Inserts layer_size new neurons with activation act right after the inputs:
+ * an 8-5-1 net becomes 8-layer_size-5-1. The first two weight matrices are reinitialized. */
+void add_hidden_layer_act(NeuralNet *ann, int layer_size, Activation act) {
+    Layer *first = ann->input;
+    Dim in = {first->dim.h, layer_size};
+    Dim mid = {layer_size, first->dim.w};
+
+    Layer *input = create_layer(in, act);
+    Layer *new = create_layer(mid, first->act);
+    input->next = new;
+    new->prev = input;
+    new->next = first->next;
+    first->next->prev = new;
+
+    ann->input = input;
+    free_layer(first);
+    net_changed(ann);
 }
 
 
-/* Adds a new layer to the neural nerwork */ /*
+/* Adds a new layer to the neural nerwork */
 void add_hidden_layer(NeuralNet *ann, int layer_size) {
-    Layer *new = (Layer*) malloc(sizeof(Layer));
-    ann->input->dim.w = layer_size;
-    new->dim.h = layer_size;
-    new->dim.w = ann->input->next->dim.h;
-    new->in = allocate_float_1d(new->dim.w);
-    new->out = allocate_float_1d(new->dim.w);
-    fill_zero(new->in, new->dim.w);
-    fill_zero(new->out, new->dim.w);
-
-    free_float_2d(ann->input->weights, ann->input->dim.h);
-    free_float_2d(ann->input->next->weights, ann->input->next->dim.h);
-    free_float_1d(ann->input->in);
-    free_float_1d(ann->input->out);
-
-    new->weights = allocate_float_2d(new->dim.h, new->dim.w);
-    ann->input->weights = allocate_float_2d(ann->input->dim.h, ann->input->dim.w);
-    ann->input->next->weights = allocate_float_2d(ann->input->next->dim.h, ann->input->next->dim.w);
-    ann->input->in = allocate_float_1d(ann->input->dim.w);
-    ann->input->out = allocate_float_1d(ann->input->dim.w);
-
-    init_weight_matrix(ann->input->weights, ann->input->dim);
-    init_weight_matrix(ann->input->next->weights, ann->input->next->dim);
-    init_weight_matrix(new->weights, new->dim);
-    fill_zero(ann->input->in, ann->input->dim.w);
-    fill_zero(ann->input->out, ann->input->dim.w);
-
-    new->next = ann->input->next;
-    new->prev = ann->input;
-    ann->input->next = new;
-    ann->input->next->prev = new;
+    add_hidden_layer_act(ann, layer_size, ann->input->act);
+}
+
+
+/* Applies the activation function of a layer on its weighted inputs */
+static void activate_layer(Layer *layer) {
+    activate(layer->act, layer->in, layer->out, layer->dim.w);
+}
+
+
+/* A slice of a layer for the thread pool */
+typedef struct ForwardTiles {
+    Layer *layer;
+    const float *x;
+    int tile;
+} ForwardTiles;
+
+
+/* Computes the weighted inputs of outputs [from, to) and activates them if the activation is elementwise */
+static void forward_outputs(Layer *layer, const float *x, int from, int to) {
+    fill_zero(&layer->in[from], to - from);
+    for (int j = 0; j < layer->dim.h; ++j) {
+        const float *w = layer->weights[j];
+        float xj = x[j];
+        for (int k = from; k < to; ++k)
+            layer->in[k] += xj * w[k];
+    }
+    if (layer->act != ACT_SOFTMAX)
+        activate(layer->act, &layer->in[from], &layer->out[from], to - from);
+}
+
+
+static void forward_tile(void *arg, int task) {
+    ForwardTiles *t = (ForwardTiles*) arg;
+    int from = task * t->tile;
+    int to = from + t->tile < t->layer->dim.w ? from + t->tile : t->layer->dim.w;
+    forward_outputs(t->layer, t->x, from, to);
+}
+
+
+/* Computes the weighted inputs of a layer row by row, then activates it. Wide
+ * layers are split into tiles of output neurons when a thread pool is set. */
+static void forward_layer(Layer *layer, const float *x) {
+    ThreadPool *pool = tann_thread_pool();
+    if (pool != NULL && (long) layer->dim.h * layer->dim.w >= TANN_PARALLEL_MIN_WORK) {
+        /* A few tiles per thread to balance the load, whole cache lines so no tile shares one */
+        int n = thread_pool_size(pool);
+        ForwardTiles t = {layer, x, (layer->dim.w / (4 * n) + 15) / 16 * 16};
+        if (t.tile < 64)
+            t.tile = 64;
+        if (thread_pool_run(pool, (layer->dim.w + t.tile - 1) / t.tile, forward_tile, &t) == 0) {
+            if (layer->act == ACT_SOFTMAX)
+                activate_layer(layer);
+            return;
+        }
+    }
+
+    forward_outputs(layer, x, 0, layer->dim.w);
+    if (layer->act == ACT_SOFTMAX)
+        activate_layer(layer);
+}
+
+
+/* Computes the weighted inputs of the first layer from the non-zero features of a CSR row */
+static void forward_layer_sparse(Layer *layer, const int *col, const float *val, int nnz) {
+    fill_zero(layer->in, layer->dim.w);
+    for (int p = 0; p < nnz; ++p) {
+        const float *w = layer->weights[col[p]];
+        float xj = val[p];
+        for (int k = 0; k < layer->dim.w; ++k)
+            layer->in[k] += xj * w[k];
+    }
+    activate_layer(layer);
+}
+
+
+/* Feeds the output of the first layer through the rest of the net */
+static void feed_forward_hidden(NeuralNet *ann, tann_stats *stats, double t) {
+    int layer = 0;
+    if (stats != NULL) {
+        double now = wall_time();
+        tann_stats_add_forward(stats, layer, now - t);
+        t = now;
+    }
+
+    for (Layer *iter = ann->input->next; iter != NULL; iter = iter->next) {
+        forward_layer(iter, iter->prev->out);
+
+        ++layer;
+        if (stats != NULL) {
+            double now = wall_time();
+            tann_stats_add_forward(stats, layer, now - t);
+            t = now;
+        }
+    }
 }
- */
 
 
 /* Feeds forward data in the neural network*/
 void feed_forward_net(NeuralNet *ann, float *X) {
-    for (int i = 0; i < ann->input->dim.w; ++i) {
-        float *r = get_row(ann->input->weights, ann->input->dim.h, i);
-        ann->input->in[i] = dot_product(X, r, ann->input->dim.h);
-        ann->input->out[i] = sigmoid(ann->input->in[i]);
-        free(r);
+    tann_stats *stats = tann_stats_active();
+    double t = 0;
+    if (stats != NULL)
+        t = tann_stats_clock(stats);
+
+    forward_layer(ann->input, X);
+    feed_forward_hidden(ann, stats, t);
+}
+
+
+/* Feeds forward the row-th sample of a CSR matrix */
+void feed_forward_sparse(NeuralNet *ann, SparseMatrix *X, int row) {
+    tann_stats *stats = tann_stats_active();
+    double t = 0;
+    if (stats != NULL)
+        t = tann_stats_clock(stats);
+
+    int from = X->row_ptr[row];
+    forward_layer_sparse(ann->input, &X->col[from], &X->val[from], X->row_ptr[row + 1] - from);
+    feed_forward_hidden(ann, stats, t);
+}
+
+
+/* Feeds forward n samples layer by layer through the caller's buffers, out is an n x output
+ * width matrix. Like infer_static, buf_a holds n * plan.buf_a and buf_b n * plan.buf_b floats
+ * of plan_inference, and the heap is never touched. Every weight row is loaded once per layer
+ * for the whole batch. Only the weights are read, so any number of threads may share the net. */
+void feed_forward_batch_static(NeuralNet *ann, float **X, int n, float **out, float *buf_a, float *buf_b) {
+    const float *in = NULL;
+    float *res = buf_a;
+
+    /* The rows of a layer's result are packed with the width of the layer */
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        int h = iter->dim.h, w = iter->dim.w;
+        fill_zero(res, n * w);
+        for (int j = 0; j < h; ++j) {
+            const float *wj = iter->weights[j];
+            for (int s = 0; s < n; ++s) {
+                float xj = in != NULL ? in[s * h + j] : X[s][j];
+                float *dst = &res[s * w];
+                for (int k = 0; k < w; ++k)
+                    dst[k] += xj * wj[k];
+            }
+        }
+        for (int s = 0; s < n; ++s)
+            activate(iter->act, &res[s * w], &res[s * w], w);
+
+        in = res;
+        res = res == buf_a ? buf_b : buf_a;
     }
 
-    Layer *iter;
-    for (iter = ann->input->next; iter != NULL; iter=iter->next) {
-        for (int i = 0; i < iter->dim.w; ++i) {
-            float *r = get_row(iter->weights, iter->dim.h, i);
-            iter->in[i] = dot_product(iter->prev->out, r, iter->dim.h);
-            iter->out[i] = sigmoid(iter->in[i]);
-            free(r);
+    int w = ann->output->dim.w;
+    for (int s = 0; s < n; ++s)
+        memcpy(out[s], &in[s * w], sizeof(float) * w);
+}
+
+
+/* Same as feed_forward_batch_static with buffers allocated for the call */
+void feed_forward_batch(NeuralNet *ann, float **X, int n, float **out) {
+    InferencePlan plan;
+    plan_inference(ann, &plan);
+    float *a = allocate_float_1d(n * plan.buf_a);
+    float *b = allocate_float_1d(n * plan.buf_b);
+    feed_forward_batch_static(ann, X, n, out, a, b);
+    free_float_1d(a);
+    free_float_1d(b);
+}
+
+
+/* Class predicted from an output of the net, like the one returned by infer_static */
+int predict_class_from(NeuralNet *ann, const float *out) {
+    if (ann->output->act != ACT_SOFTMAX)
+        return (int) (out[0] + 0.5);
+
+    int best = 0;
+    for (int k = 1; k < ann->output->dim.w; ++k)
+        if (out[k] > out[best])
+            best = k;
+    return best;
+}
+
+
+/* Class predicted by the output layer of the net */
+int predict_class(NeuralNet *ann) {
+    return predict_class_from(ann, ann->output->out);
+}
+
+
+/* Computes the delta of the output layer for one sample, returns the loss */
+static float output_delta(Layer *out, const float *y) {
+    if (out->act == ACT_SOFTMAX)
+        return softmax_cross_entropy(out->in, out->out, out->delta, out->dim.w, (int) y[0]);
+
+    float loss = 0;
+    for (int k = 0; k < out->dim.w; ++k) {
+        float err = y[k] - out->out[k];
+        out->delta[k] = err;
+        loss += err * err * (float) 0.5;
+    }
+    activation_delta(out->act, out->out, out->delta, out->dim.w);
+    return loss;
+}
+
+
+/* Backpropagates the delta of a layer to the previous one */
+static void hidden_delta(Layer *layer) {
+    Layer *next = layer->next;
+    for (int j = 0; j < layer->dim.w; ++j)
+        layer->delta[j] = dot_product(next->weights[j], next->delta, next->dim.w);
+    activation_delta(layer->act, layer->out, layer->delta, layer->dim.w);
+}
+
+
+/* Adds the gradient of a layer to its weights */
+static void update_layer(Layer *layer, const float *x) {
+    for (int j = 0; j < layer->dim.h; ++j) {
+        float *w = layer->weights[j];
+        float xj = x[j];
+        for (int k = 0; k < layer->dim.w; ++k)
+            w[k] += xj * layer->delta[k];
+    }
+}
+
+
+/* Adds the gradient of the first layer to the rows of the non-zero features only */
+static void update_layer_sparse(Layer *layer, const int *col, const float *val, int nnz) {
+    for (int p = 0; p < nnz; ++p) {
+        float *w = layer->weights[col[p]];
+        float xj = val[p];
+        for (int k = 0; k < layer->dim.w; ++k)
+            w[k] += xj * layer->delta[k];
+    }
+}
+
+
+/* Computes the deltas of every layer after a feed forward, returns the loss or -1 if the
+ * label of a softmax output is out of range */
+static float compute_deltas(NeuralNet *ann, float *y) {
+    /* Every delta is computed with the old weights before any update */
+    float loss = output_delta(ann->output, y);
+    if (loss < 0)
+        return -1;
+    for (Layer *iter = ann->output->prev; iter != NULL; iter = iter->prev)
+        hidden_delta(iter);
+    return loss;
+}
+
+
+/* Makes one gradient step on a single sample, returns the loss, or -1 if the sample was skipped
+ * for a bad label. If col is not NULL, X holds the nnz values of a CSR row with their column
+ * indices in col. */
+static float train_sample(NeuralNet *ann, float *X, const int *col, int nnz, float *y, tann_stats *stats) {
+    double t = 0;
+    if (stats != NULL)
+        t = tann_stats_clock(stats);
+
+    float loss = compute_deltas(ann, y);
+    if (loss < 0)
+        return -1;
+
+    int layer = 0;
+    for (Layer *iter = ann->input; iter->next != NULL; iter = iter->next)
+        ++layer;
+
+    for (Layer *iter = ann->output; iter != NULL; iter = iter->prev, --layer) {
+        if (iter->prev != NULL)
+            update_layer(iter, iter->prev->out);
+        else if (col != NULL)
+            update_layer_sparse(iter, col, X, nnz);
+        else
+            update_layer(iter, X);
+
+        if (stats != NULL) {
+            double now = wall_time();
+            tann_stats_add_backward(stats, layer, now - t);
+            t = now;
         }
     }
+
+    if (stats != NULL)
+        stats->samples++;
+    return loss;
 }
 
 
-/* Trains the neural network  */
-void train_net(NeuralNet *ann, float **X, float **y, float *J, float *acc, Dim dim, int n_epoch) {
-    float *delta_second_layer = allocate_float_1d(ann->output->dim.h);
-    clock_t start, end;
-    start = clock();
+/* Trains the neural network for a single epoch, returns the error and the accuracy */
+void train_epoch(NeuralNet *ann, float **X, float **y, Dim dim, float *J, float *acc) {
+    tann_stats *stats = tann_stats_active();
+    double epoch_start = wall_time();
+    float sum_err = 0;
+    int correct = 0;
 
-    for (int step = 0; step < n_epoch; ++step) {
-        float sum_err = 0;
-        int correct = 0;
+    for (int i = 0; i < dim.h; ++i) {
+        feed_forward_net(ann, X[i]);
 
-        for (int i = 0; i < dim.h; ++i) {
-            feed_forward_net(ann, X[i]);
+        if (predict_class(ann) == (int) y[i][0])
+            correct++;
 
-            if ((int) (ann->output->out[0] + 0.5) == (int) y[i][0])
-                correct++;
+        sum_err += fmaxf(train_sample(ann, X[i], NULL, 0, y[i], stats), 0);
+    }
 
-            float error_last_layer = y[i][0] - ann->output->out[0];
-            float delta_last_layer = error_last_layer * sigmoid_der(ann->output->out[0]);
+    /* One new version per call, a shared counter bumped per sample would be contended */
+    net_changed(ann);
+    *J = sum_err;
+    *acc = (float) correct / (float) dim.h;
 
-            for (int j = 0; j < ann->output->dim.h; ++j) {
-                delta_second_layer[j] = ann->output->weights[j][0] * delta_last_layer * sigmoid_der(ann->output->prev->out[j]);
-            }
+    if (stats != NULL) {
+        stats->last_epoch_sec = wall_time() - epoch_start;
+        stats->epochs++;
+    }
+}
 
-            for (int j = 0; j < ann->output->dim.h; ++j) {
-                for (int k = 0; k < ann->output->dim.w; ++k) {
-                    ann->output->weights[j][k] += delta_last_layer * ann->input->out[j];
-                }
-            }
 
-            for (int j = 0; j < ann->input->dim.h; ++j) {
-                for (int k = 0; k < ann->input->dim.w; ++k) {
-                    ann->input->weights[j][k] += X[i][j] * delta_second_layer[k];
-                }
-            }
+/* Trains the neural network for a single epoch on CSR encoded samples */
+void train_epoch_sparse(NeuralNet *ann, SparseMatrix *X, float **y, float *J, float *acc) {
+    tann_stats *stats = tann_stats_active();
+    double epoch_start = wall_time();
+    float sum_err = 0;
+    int correct = 0;
+
+    for (int i = 0; i < X->dim.h; ++i) {
+        feed_forward_sparse(ann, X, i);
+
+        if (predict_class(ann) == (int) y[i][0])
+            correct++;
+
+        int from = X->row_ptr[i];
+        sum_err += fmaxf(train_sample(ann, &X->val[from], &X->col[from], X->row_ptr[i + 1] - from, y[i], stats), 0);
+    }
+
+    net_changed(ann);
+    *J = sum_err;
+    *acc = (float) correct / (float) X->dim.h;
+
+    if (stats != NULL) {
+        stats->last_epoch_sec = wall_time() - epoch_start;
+        stats->epochs++;
+    }
+}
+
+
+/* One train_epoch pass for pruning: a weight whose mask[layer][i][j] is 0 is zeroed again after every
+ * step, so it never feeds the next sample. The net gets no new version and no online-learning state,
+ * the caller bumps the version once it is done. */
+void train_epoch_masked(NeuralNet *ann, float **X, float **y, Dim dim, float ***mask) {
+    tann_stats *stats = tann_stats_active();
+    for (int i = 0; i < dim.h; ++i) {
+        feed_forward_net(ann, X[i]);
+        if (train_sample(ann, X[i], NULL, 0, y[i], stats) < 0)
+            continue;
+
+        int l = 0;
+        for (Layer *iter = ann->input; iter != NULL; iter = iter->next, ++l)
+            for (int j = 0; j < iter->dim.h; ++j)
+                for (int k = 0; k < iter->dim.w; ++k)
+                    iter->weights[j][k] *= mask[l][j][k];
+    }
+}
+
+
+/* Number of weights of a net, the length of a flattened gradient */
+int net_param_count(NeuralNet *ann) {
+    int n = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+        n += iter->dim.h * iter->dim.w;
+    return n;
+}
+
+
+/* Adds the step train_epoch would make on the last fed forward sample to grad instead of the
+ * weights. grad holds the weight matrices from the input layer on, row after row. Returns the
+ * loss, or -1 without touching grad if the label is out of range. */
+float accumulate_gradient(NeuralNet *ann, float *X, float *y, float *grad) {
+    float loss = compute_deltas(ann, y);
+    if (loss < 0)
+        return -1;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        const float *x = iter->prev != NULL ? iter->prev->out : X;
+        for (int j = 0; j < iter->dim.h; ++j) {
+            float xj = x[j];
+            for (int k = 0; k < iter->dim.w; ++k)
+                grad[k] += xj * iter->delta[k];
+            grad += iter->dim.w;
+        }
+    }
+    return loss;
+}
+
 
-            sum_err += error_last_layer * error_last_layer * (float) 0.5;
+/* Adds scale times a flattened gradient to the weights */
+void apply_gradient(NeuralNet *ann, const float *grad, float scale) {
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        for (int j = 0; j < iter->dim.h; ++j) {
+            float *w = iter->weights[j];
+            for (int k = 0; k < iter->dim.w; ++k)
+                w[k] += scale * grad[k];
+            grad += iter->dim.w;
         }
+    }
+    net_changed(ann);
+}
+
+
+/* Online learning on a stream: every call makes one gradient step on each of the n samples,
+ * so its cost only depends on n. The number of samples seen and a moving average of the loss
+ * are kept in the net between calls. Returns the mean loss of the samples learned, the ones with
+ * a bad label are skipped. */
+float partial_fit(NeuralNet *ann, float **X, float **y, int n) {
+    tann_stats *stats = tann_stats_active();
+    float sum_err = 0;
+    int n_learned = 0;
+
+    for (int i = 0; i < n; ++i) {
+        feed_forward_net(ann, X[i]);
+        float loss = train_sample(ann, X[i], NULL, 0, y[i], stats);
+        if (loss < 0)
+            continue;
+        sum_err += loss;
+        n_learned++;
+
+        if (ann->n_seen == 0)
+            ann->running_loss = loss;
+        else
+            ann->running_loss = TANN_LOSS_DECAY * ann->running_loss + (1 - TANN_LOSS_DECAY) * loss;
+        ann->n_seen++;
+    }
+
+    if (n_learned > 0)
+        net_changed(ann);
+    return n_learned > 0 ? sum_err / (float) n_learned : 0;
+}
+
+
+/* Trains the neural network on CSR encoded samples */
+void train_net_sparse(NeuralNet *ann, SparseMatrix *X, float **y, float *J, float *acc, int n_epoch) {
+    tann_stats *stats = tann_stats_active();
+    double start = wall_time();
 
-        J[step] = sum_err;
-        acc[step] = (float) correct / (float) dim.h;
+    for (int step = 0; step < n_epoch; ++step) {
+        train_epoch_sparse(ann, X, y, &J[step], &acc[step]);
 
         if (step % 50 == 0)
             printf("Epoch: %d   Error: %0.3f   Accuracy: %0.3f\n", step, J[step], acc[step]);
     }
 
-    free_float_1d(delta_second_layer);
-    end = clock();
-    float training_time = (float) (end-start) / CLOCKS_PER_SEC;
+    float training_time = (float) (wall_time() - start);
+    if (stats != NULL)
+        stats->train_sec += training_time;
     printf("Training took: %0.3f sec\n", training_time);
 }
 
 
-/* Testing accuracy on the given neural network  */
-void test_net(NeuralNet *ann, float **X, float **y, Dim dim) {
-    int correct = 0;
-    float rmse = 0;
-    float mae = 0;
+/* Trains the neural network from epoch start_epoch, taking snapshots into ckpt (may be NULL) */
+void train_net_from(NeuralNet *ann, float **X, float **y, float *J, float *acc, Dim dim,
+                    int start_epoch, int n_epoch, Checkpoint *ckpt) {
+    tann_stats *stats = tann_stats_active();
+    double start = wall_time();
 
-    for (int i = 0; i < dim.h - 1; ++i) {
-        feed_forward_net(ann, X[i]);
-        if ((int) (ann->output->out[0] + 0.5) == (int) y[i][0])
-            correct++;
+    for (int step = start_epoch; step < n_epoch; ++step) {
+        train_epoch(ann, X, y, dim, &J[step], &acc[step]);
 
-        rmse += (y[i][0] - ann->output->out[0]) * (y[i][0] - ann->output->out[0]);
-        mae += fabs((double) (y[i][0] - ann->output->out[0]));
+        if (ckpt != NULL)
+            checkpoint_step(ckpt, ann, J, acc, step + 1, step == n_epoch - 1);
+
+        if (step % 50 == 0)
+            printf("Epoch: %d   Error: %0.3f   Accuracy: %0.3f\n", step, J[step], acc[step]);
     }
 
-    rmse = (float) sqrt((double) (rmse / (float) dim.h));
-    mae = mae / (float) dim.h;
-    printf("\nTest Accuracy: %f   Correct: %d   Misclassified: %d\n",
-            (float) correct / (float) dim.h,
-            correct, dim.h - correct);
-    printf("Root Mean Squared Error: %f\n", rmse);
-    printf("Mean Absolute Error: %f\n", mae);
+    float training_time = (float) (wall_time() - start);
+    if (stats != NULL)
+        stats->train_sec += training_time;
+    printf("Training took: %0.3f sec\n", training_time);
 }
 
+
+/* Trains the neural network  */
+void train_net(NeuralNet *ann, float **X, float **y, float *J, float *acc, Dim dim, int n_epoch) {
+    train_net_from(ann, X, y, J, acc, dim, 0, n_epoch, NULL);
+}
+
+
+/* Testing accuracy on the given neural network  */
+void test_net(NeuralNet *ann, float **X, float **y, Dim dim) {
+    EvalResult res;
+    eval_net(ann, X, y, dim, 1, &res);
+
+    printf("\nTest Accuracy: %f   Correct: %d   Misclassified: %d\n",
+            res.accuracy, res.correct, res.n - res.correct);
+    printf("Root Mean Squared Error: %f\n", res.rmse);
+    printf("Mean Absolute Error: %f\n", res.mae);
+}
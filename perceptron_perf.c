@@ -0,0 +1,109 @@
+/*
+ * This file contains the hardware performance counters of the
+ * instrumentation layer. On Linux they are opened with perf_event_open
+ * for the calling thread and user space only: cycles, instructions, L1
+ * data cache read misses, last level cache misses and branch misses.
+ * Every counter is opened on its own, so a missing one (common in virtual
+ * machines or with a strict perf_event_paranoid) only drops that column.
+ * Everywhere else tann_perf_open simply reports that nothing is counted.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "perceptron.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+
+/* Names of the counters in the order of tann_perf_event */
+static const char *event_names[TANN_PERF_EVENTS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+
+const char *tann_perf_event_name(int event) {
+    return event >= 0 && event < TANN_PERF_EVENTS ? event_names[event] : "unknown";
+}
+
+
+#if defined(__linux__)
+
+static int open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+/* Opens the counters on the calling thread, returns how many of them work */
+int tann_perf_open(tann_perf *perf) {
+    const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    perf->fd[TANN_PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    perf->fd[TANN_PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perf->fd[TANN_PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, l1d_read_miss);
+    perf->fd[TANN_PERF_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    perf->fd[TANN_PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+    perf->n_open = 0;
+    for (int e = 0; e < TANN_PERF_EVENTS; ++e)
+        perf->n_open += perf->fd[e] >= 0;
+    return perf->n_open;
+}
+
+
+/* Reads the counters, multiplexed ones are scaled up to the full time. Closed ones read -1. */
+void tann_perf_read(const tann_perf *perf, long long *values) {
+    for (int e = 0; e < TANN_PERF_EVENTS; ++e) {
+        uint64_t buf[3];
+        values[e] = -1;
+        if (perf->fd[e] < 0 || read(perf->fd[e], buf, sizeof(buf)) != (ssize_t) sizeof(buf))
+            continue;
+        if (buf[2] > 0 && buf[2] < buf[1])
+            buf[0] = (uint64_t) ((double) buf[0] * (double) buf[1] / (double) buf[2]);
+        values[e] = (long long) buf[0];
+    }
+}
+
+
+void tann_perf_close(tann_perf *perf) {
+    for (int e = 0; e < TANN_PERF_EVENTS; ++e) {
+        if (perf->fd[e] >= 0)
+            close(perf->fd[e]);
+        perf->fd[e] = -1;
+    }
+    perf->n_open = 0;
+}
+
+#else
+
+int tann_perf_open(tann_perf *perf) {
+    for (int e = 0; e < TANN_PERF_EVENTS; ++e)
+        perf->fd[e] = -1;
+    perf->n_open = 0;
+    return 0;
+}
+
+
+void tann_perf_read(const tann_perf *perf, long long *values) {
+    (void) perf;
+    for (int e = 0; e < TANN_PERF_EVENTS; ++e)
+        values[e] = -1;
+}
+
+
+void tann_perf_close(tann_perf *perf) {
+    perf->n_open = 0;
+}
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ * This file contains the static-memory inference path. During inference
+ * the weighted inputs of a layer are dead once the activation is applied,
+ * so a sample only needs two activation buffers: layer 0, 2, 4, ...
+ * write into the first, layer 1, 3, 5, ... into the second, and every
+ * activation is computed in place. plan_inference() computes how large
+ * the two buffers have to be, infer_static() runs a sample through the
+ * caller's buffers without touching the heap or the layer buffers, so it
+ * fits microcontrollers and is safe to call from several threads.
+ *
+ */
+
+#include "perceptron.h"
+
+
+/* Computes the buffer sizes and the memory footprint of static inference */
+void plan_inference(NeuralNet *ann, InferencePlan *plan) {
+    memset(plan, 0, sizeof(InferencePlan));
+    plan->in_w = ann->input->dim.h;
+    plan->out_w = ann->output->dim.w;
+
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        int *buf = plan->n_layers % 2 == 0 ? &plan->buf_a : &plan->buf_b;
+        if (iter->dim.w > *buf)
+            *buf = iter->dim.w;
+        plan->layer_bytes += sizeof(float) * 3 * iter->dim.w; /* in, out and delta */
+        plan->n_layers++;
+    }
+    plan->static_bytes = sizeof(float) * (plan->buf_a + plan->buf_b);
+}
+
+
+/* Prints the plan and the memory it saves compared to the layer buffers */
+void print_inference_plan(FILE *file, const InferencePlan *plan) {
+    fprintf(file, "Inference plan: %d layers, %d inputs, %d outputs\n", plan->n_layers, plan->in_w, plan->out_w);
+    fprintf(file, "  ping-pong buffers: %d + %d floats = %lu bytes\n",
+            plan->buf_a, plan->buf_b, (unsigned long) plan->static_bytes);
+    fprintf(file, "  layer buffers:     %lu bytes\n", (unsigned long) plan->layer_bytes);
+}
+
+
+/* y = act(x * W), y holds dim.w floats */
+static void infer_layer(const Layer *layer, const float *x, float *y) {
+    fill_zero(y, layer->dim.w);
+    for (int j = 0; j < layer->dim.h; ++j) {
+        const float *w = layer->weights[j];
+        float xj = x[j];
+        for (int k = 0; k < layer->dim.w; ++k)
+            y[k] += xj * w[k];
+    }
+    activate(layer->act, y, y, layer->dim.w);
+}
+
+
+/* Feeds forward a sample with the buffers of a plan: buf_a holds plan.buf_a
+ * floats, buf_b plan.buf_b floats. Returns the output, which is one of them. */
+const float *infer_static(NeuralNet *ann, const float *x, float *buf_a, float *buf_b) {
+    const float *in = x;
+    float *out = buf_a;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        infer_layer(iter, in, out);
+        in = out;
+        out = out == buf_a ? buf_b : buf_a;
+    }
+    return in;
+}
@@ -76,20 +76,203 @@ void plot_clusters(struct SDL_Renderer *renderer, float **X, float **y, int outp
 }
 
 
-void plot_trained_net(struct SDL_Renderer *renderer, NeuralNet *ann) {
-    float z = 0.5;
+/* Side of a refinement tile in pixels and the distance from the threshold where the shading
+ * of a tile is computed pixel by pixel even if all of its corners are on the same side */
+#define PLOT_TILE 8
+#define PLOT_NEAR 0.1f
+
+/* Pixels evaluated together, every batch is expanded by the feature pipeline at once */
+#define PLOT_BATCH 256
+
+
+struct PlotCache {
+    unsigned long version; /* version of the net the surface belongs to, 0 if none */
+    int n; /* side of the surface in pixels */
+    float *surface; /* output of the net at every pixel, column after column */
+    FeaturePipeline *fp;
+    float **pixels; /* expanded features of a batch of pixels */
+    int n_pixels;
+    float *buf_a, *buf_b; /* infer_static buffers */
+    int buf_a_len, buf_b_len;
+    int last_evals;
+};
+
+
+/* Creates an empty cache, the first plot fills it */
+PlotCache *create_plot_cache() {
+    PlotCache *cache = (PlotCache*) tann_calloc(1, sizeof(PlotCache));
+    int from = (int) Margin - 1;
+    cache->n = (int) (Height - Margin) - from;
+    cache->surface = allocate_float_1d(cache->n * cache->n);
+
+    /* The spiral expansion starts with [1, x, y] so it also fits the plain 2D nets */
+    cache->fp = spiral_features();
+    cache->n_pixels = PLOT_BATCH;
+    cache->pixels = allocate_float_2d(cache->n_pixels, cache->fp->n_ops);
+    return cache;
+}
+
+
+void free_plot_cache(PlotCache *cache) {
+    free_float_1d(cache->surface);
+    free_float_2d(cache->pixels, cache->n_pixels);
+    free_feature_pipeline(cache->fp);
+    free_float_1d(cache->buf_a);
+    free_float_1d(cache->buf_b);
+    tann_free(cache);
+}
+
+
+/* Net evaluations of the last plot, 0 if the surface was reused */
+int plot_cache_last_evals(PlotCache *cache) {
+    return cache->last_evals;
+}
+
+
+/* Evaluates the net on n pixels given by their surface coordinates, results go into res */
+static void eval_pixels(PlotCache *cache, NeuralNet *ann, const int *px, const int *py, int n, float *res) {
     float size = 540.0;
+    for (int k = 0; k < n; ++k) {
+        cache->pixels[k][0] = 1;
+        cache->pixels[k][1] = ((float) px[k] - 1) / size;
+        cache->pixels[k][2] = ((float) py[k] - 1) / size;
+    }
+    feature_pipeline_apply(cache->fp, cache->pixels, cache->pixels, n);
+    for (int k = 0; k < n; ++k)
+        res[k] = infer_static(ann, cache->pixels[k], cache->buf_a, cache->buf_b)[0];
+    cache->last_evals += n;
+}
+
+
+/* Grows the infer_static buffers to the needs of a net */
+static void plan_buffers(PlotCache *cache, NeuralNet *ann) {
+    InferencePlan plan;
+    plan_inference(ann, &plan);
+    if (plan.buf_a > cache->buf_a_len) {
+        free_float_1d(cache->buf_a);
+        cache->buf_a = allocate_float_1d(plan.buf_a);
+        cache->buf_a_len = plan.buf_a;
+    }
+    if (plan.buf_b > cache->buf_b_len) {
+        free_float_1d(cache->buf_b);
+        cache->buf_b = allocate_float_1d(plan.buf_b);
+        cache->buf_b_len = plan.buf_b;
+    }
+}
 
-    // Float loop corrected with Machine Epsilon
-    float i, j;
-    for (int x = (int) Margin - 1; x < Height - Margin ; ++x) {
-        for (int y = (int) Margin - 1; y < Height - Margin; ++y) {
-            i =((float) x - Margin)/ size;
-            j = ((float) y - Margin) / size;
 
-            float pixel[8] = {1, i, j, (float) sin(i * 10), (float) sin(j * 10), i * j, i * i, j * j};
-            feed_forward_net(ann, pixel);
-            float res = ann->output->out[0];
+/* First pixel of a tile along one axis, the last tile ends at the edge */
+static int tile_start(PlotCache *cache, int t) {
+    int p = t * PLOT_TILE;
+    return p < cache->n - 1 ? p : cache->n - 1;
+}
+
+
+/* Whether the decision boundary may cross a tile, judged by the outputs at its corners */
+static int boundary_tile(PlotCache *cache, int tx, int ty) {
+    float z = 0.5;
+    int n = cache->n;
+    int x0 = tile_start(cache, tx), x1 = tile_start(cache, tx + 1);
+    int y0 = tile_start(cache, ty), y1 = tile_start(cache, ty + 1);
+    float *s = cache->surface;
+    float lo = fminf(fminf(s[x0 * n + y0], s[x0 * n + y1]), fminf(s[x1 * n + y0], s[x1 * n + y1]));
+    float hi = fmaxf(fmaxf(s[x0 * n + y0], s[x0 * n + y1]), fmaxf(s[x1 * n + y0], s[x1 * n + y1]));
+    return (lo < z && hi >= z) || fabsf(lo - z) < PLOT_NEAR || fabsf(hi - z) < PLOT_NEAR;
+}
+
+
+/* Recomputes the surface by adaptive refinement: the net is only evaluated at the corners of the
+ * tiles, and the tiles that the decision boundary may cross are refined pixel by pixel. The rest
+ * is interpolated. Both passes run in this call, the surface is only drawn once it is complete. */
+static void compute_surface(PlotCache *cache, NeuralNet *ann) {
+    int n = cache->n, n_tiles = (n - 1 + PLOT_TILE - 1) / PLOT_TILE;
+    int px[PLOT_BATCH], py[PLOT_BATCH];
+    float res[PLOT_BATCH];
+    float *s = cache->surface;
+    int cnt = 0;
+
+    plan_buffers(cache, ann);
+    cache->last_evals = 0;
+
+    /* Coarse grid on the corners of the tiles */
+    for (int tx = 0; tx <= n_tiles; ++tx) {
+        for (int ty = 0; ty <= n_tiles; ++ty) {
+            px[cnt] = tile_start(cache, tx);
+            py[cnt++] = tile_start(cache, ty);
+            if (cnt == PLOT_BATCH || (tx == n_tiles && ty == n_tiles)) {
+                eval_pixels(cache, ann, px, py, cnt, res);
+                for (int k = 0; k < cnt; ++k)
+                    s[px[k] * n + py[k]] = res[k];
+                cnt = 0;
+            }
+        }
+    }
+
+    /* Smooth tiles are interpolated first, so the refined ones can overwrite the shared edges */
+    for (int tx = 0; tx < n_tiles; ++tx) {
+        for (int ty = 0; ty < n_tiles; ++ty) {
+            if (boundary_tile(cache, tx, ty))
+                continue;
+            int x0 = tile_start(cache, tx), x1 = tile_start(cache, tx + 1);
+            int y0 = tile_start(cache, ty), y1 = tile_start(cache, ty + 1);
+            float c00 = s[x0 * n + y0], c01 = s[x0 * n + y1];
+            float c10 = s[x1 * n + y0], c11 = s[x1 * n + y1];
+            for (int x = x0; x <= x1; ++x) {
+                float u = (float) (x - x0) / (float) (x1 - x0);
+                for (int y = y0; y <= y1; ++y) {
+                    float v = (float) (y - y0) / (float) (y1 - y0);
+                    s[x * n + y] = (1 - u) * ((1 - v) * c00 + v * c01) + u * ((1 - v) * c10 + v * c11);
+                }
+            }
+        }
+    }
+
+    for (int tx = 0; tx < n_tiles; ++tx) {
+        for (int ty = 0; ty < n_tiles; ++ty) {
+            if (!boundary_tile(cache, tx, ty))
+                continue;
+            int x0 = tile_start(cache, tx), x1 = tile_start(cache, tx + 1);
+            int y0 = tile_start(cache, ty), y1 = tile_start(cache, ty + 1);
+            for (int x = x0; x <= x1; ++x) {
+                for (int y = y0; y <= y1; ++y) {
+                    /* The corners are exact already */
+                    if ((x == x0 || x == x1) && (y == y0 || y == y1))
+                        continue;
+                    px[cnt] = x;
+                    py[cnt++] = y;
+                    if (cnt == PLOT_BATCH) {
+                        eval_pixels(cache, ann, px, py, cnt, res);
+                        for (int k = 0; k < cnt; ++k)
+                            s[px[k] * n + py[k]] = res[k];
+                        cnt = 0;
+                    }
+                }
+            }
+        }
+    }
+    if (cnt > 0) {
+        eval_pixels(cache, ann, px, py, cnt, res);
+        for (int k = 0; k < cnt; ++k)
+            s[px[k] * n + py[k]] = res[k];
+    }
+    cache->version = ann->version;
+}
+
+
+/* Draws the decision surface of a net, it is only recomputed if the net changed since the last call */
+void plot_trained_net_cached(struct SDL_Renderer *renderer, NeuralNet *ann, PlotCache *cache) {
+    float z = 0.5;
+    int from = (int) Margin - 1;
+
+    if (cache->version != ann->version)
+        compute_surface(cache, ann);
+    else
+        cache->last_evals = 0;
+
+    for (int i = 0; i < cache->n; ++i) {
+        for (int k = 0; k < cache->n; ++k) {
+            int x = from + i, y = from + k;
+            float res = cache->surface[i * cache->n + k];
             if (res >= z) {
                 pixelRGBA(renderer, (Sint16) x, (Sint16) y,
                           130, 0, 120, (Uint8) ((res - 0.5) * 255));
@@ -102,6 +285,13 @@ void plot_trained_net(struct SDL_Renderer *renderer, NeuralNet *ann) {
 }
 
 
+void plot_trained_net(struct SDL_Renderer *renderer, NeuralNet *ann) {
+    PlotCache *cache = create_plot_cache();
+    plot_trained_net_cached(renderer, ann, cache);
+    free_plot_cache(cache);
+}
+
+
 /* Plots error graph on SDL window */
 void plot_error_scaled(struct SDL_Renderer *renderer, float *J, int step, Uint32 color) {
     Sint16 def_poz_x = Width / 2 + Margin;
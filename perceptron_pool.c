@@ -0,0 +1,251 @@
+/*
+ * This file contains a persistent work-stealing thread pool used for
+ * intra-layer parallelism. thread_pool_run() splits tasks 0..n-1 into one
+ * contiguous range per thread (the calling thread takes part too). Every
+ * thread pops tasks from the front of its own range and, when it runs
+ * dry, steals the back half of another thread's range. A range is packed
+ * into a single 64 bit word, so popping and stealing are one compare and
+ * swap each. Idle workers spin for a short while before they go to sleep,
+ * so back to back layers don't pay for a wake-up.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sched.h>
+#include "perceptron.h"
+
+/* Polls of an idle worker before it sleeps on the condition variable */
+#define POOL_SPIN 20000
+
+
+/* Remaining tasks [lo, hi) of a thread packed as lo << 32 | hi, padded to a cache line */
+typedef struct PoolDeque {
+    uint64_t range;
+    char pad[56];
+} PoolDeque;
+
+
+typedef struct PoolWorker {
+    struct ThreadPool *pool;
+    int id;
+} PoolWorker;
+
+
+struct ThreadPool {
+    int n_threads; /* workers plus the calling thread */
+    pthread_t *threads;
+    PoolWorker *workers;
+    PoolDeque *deques;
+
+    pthread_mutex_t lock; /* guards joining a job and posting a new one */
+    pthread_mutex_t run_lock; /* one thread_pool_run at a time */
+    pthread_cond_t wake;
+    unsigned generation;
+    int open; /* workers may still join the current job */
+    int stop;
+    int active; /* workers inside the current job */
+    int done; /* finished tasks of the current job */
+    int n_tasks;
+    void (*fn)(void *arg, int task);
+    void *arg;
+};
+
+
+/* Read by every thread that feeds forward, accessed atomically only */
+static ThreadPool *forward_pool = NULL;
+
+
+static uint64_t pack_range(uint32_t lo, uint32_t hi) {
+    return (uint64_t) lo << 32 | hi;
+}
+
+
+/* Takes the next task of the thread's own range, returns -1 if it is empty */
+static int pop_task(PoolDeque *d) {
+    uint64_t r = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t lo = (uint32_t) (r >> 32), hi = (uint32_t) r;
+        if (lo >= hi)
+            return -1;
+        if (__atomic_compare_exchange_n(&d->range, &r, pack_range(lo + 1, hi), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return (int) lo;
+    }
+}
+
+
+/* Moves the back half of a victim's range into the thief's range, returns 0 on success */
+static int steal_tasks(PoolDeque *victim, PoolDeque *thief) {
+    uint64_t r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t lo = (uint32_t) (r >> 32), hi = (uint32_t) r;
+        if (lo >= hi)
+            return -1;
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (__atomic_compare_exchange_n(&victim->range, &r, pack_range(lo, mid), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&thief->range, pack_range(mid, hi), __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+}
+
+
+/* Runs tasks until every range of the job is empty */
+static void run_tasks(ThreadPool *pool, int id, void (*fn)(void *arg, int task), void *arg) {
+    PoolDeque *own = &pool->deques[id];
+    for (;;) {
+        int task = pop_task(own);
+        if (task >= 0) {
+            fn(arg, task);
+            __atomic_add_fetch(&pool->done, 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+
+        int stolen = 0;
+        for (int i = 1; i < pool->n_threads && !stolen; ++i)
+            stolen = steal_tasks(&pool->deques[(id + i) % pool->n_threads], own) == 0;
+        if (!stolen)
+            return;
+    }
+}
+
+
+static void *pool_worker(void *arg) {
+    PoolWorker *w = (PoolWorker*) arg;
+    ThreadPool *pool = w->pool;
+    unsigned seen = 0;
+
+    for (;;) {
+        for (int spin = 0; spin < POOL_SPIN; ++spin)
+            if (__atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) != seen ||
+                __atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+                break;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        if (!pool->open) {
+            /* Woke up after the job was finished */
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        pool->active++;
+        void (*fn)(void *, int) = pool->fn;
+        void *job_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool, w->id, fn, job_arg);
+        __atomic_sub_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+
+/* Starts n_threads - 1 workers, the thread calling thread_pool_run is the last one. If a worker
+ * can't be started, the pool keeps the ones that did. */
+ThreadPool *create_thread_pool(int n_threads) {
+    if (n_threads < 1)
+        n_threads = 1;
+    ThreadPool *pool = (ThreadPool*) tann_calloc(1, sizeof(ThreadPool));
+    pool->n_threads = n_threads;
+    pool->threads = (pthread_t*) tann_alloc(sizeof(pthread_t) * n_threads);
+    pool->workers = (PoolWorker*) tann_alloc(sizeof(PoolWorker) * n_threads);
+    pool->deques = (PoolDeque*) tann_calloc(n_threads, sizeof(PoolDeque));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (int t = 1; t < n_threads; ++t) {
+        pool->workers[t].pool = pool;
+        pool->workers[t].id = t;
+        if (pthread_create(&pool->threads[t], NULL, pool_worker, &pool->workers[t]) != 0) {
+            /* No job has been posted yet, so the running workers don't look at n_threads */
+            pool->n_threads = t;
+            break;
+        }
+    }
+    return pool;
+}
+
+
+/* Stops the workers and frees the pool */
+void free_thread_pool(ThreadPool *pool) {
+    ThreadPool *expected = pool;
+    __atomic_compare_exchange_n(&forward_pool, &expected, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 1; t < pool->n_threads; ++t)
+        pthread_join(pool->threads[t], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_cond_destroy(&pool->wake);
+    tann_free(pool->threads);
+    tann_free(pool->workers);
+    tann_free(pool->deques);
+    tann_free(pool);
+}
+
+
+/* Number of threads working on a job, the caller included */
+int thread_pool_size(ThreadPool *pool) {
+    return pool->n_threads;
+}
+
+
+/* Runs fn(arg, task) for every task in [0, n_tasks) and returns when all of them are done.
+ * Returns -1 without running anything if another thread is using the pool. */
+int thread_pool_run(ThreadPool *pool, int n_tasks, void (*fn)(void *arg, int task), void *arg) {
+    if (pthread_mutex_trylock(&pool->run_lock) != 0)
+        return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    for (int t = 0; t < pool->n_threads; ++t) {
+        uint32_t lo = (uint32_t) ((long) n_tasks * t / pool->n_threads);
+        uint32_t hi = (uint32_t) ((long) n_tasks * (t + 1) / pool->n_threads);
+        __atomic_store_n(&pool->deques[t].range, pack_range(lo, hi), __ATOMIC_RELAXED);
+    }
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->n_tasks = n_tasks;
+    __atomic_store_n(&pool->done, 0, __ATOMIC_RELAXED);
+    pool->open = 1;
+    __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool, 0, fn, arg);
+    while (__atomic_load_n(&pool->done, __ATOMIC_ACQUIRE) < n_tasks)
+        sched_yield();
+
+    /* No worker may join once the job is closed, the ones inside are about to leave */
+    pthread_mutex_lock(&pool->lock);
+    pool->open = 0;
+    pthread_mutex_unlock(&pool->lock);
+    while (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE) > 0)
+        sched_yield();
+
+    pthread_mutex_unlock(&pool->run_lock);
+    return 0;
+}
+
+
+/* Wide layers of feed_forward_net are split on this pool, NULL turns it off */
+void tann_set_thread_pool(ThreadPool *pool) {
+    __atomic_store_n(&forward_pool, pool, __ATOMIC_RELEASE);
+}
+
+
+/* Pool used by feed_forward_net or NULL */
+ThreadPool *tann_thread_pool() {
+    return __atomic_load_n(&forward_pool, __ATOMIC_ACQUIRE);
+}
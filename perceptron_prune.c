@@ -0,0 +1,302 @@
+/*
+ * This file contains magnitude pruning and the sparse inference kernel.
+ * Pruning zeroes the smallest weights of every layer, optionally with
+ * fine-tuning epochs between the rounds. A pruned net can be converted
+ * into a SparseNet where each weight row only keeps its non-zero blocks
+ * of TANN_PRUNE_BLOCK consecutive outputs, and inference skips the rest.
+ *
+ */
+
+#include "perceptron.h"
+
+
+static int compare_float(const void *a, const void *b) {
+    float x = *(const float*) a, y = *(const float*) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Zeroes the smallest weights of a layer so that at least sparsity of them is zero */
+static void prune_layer(Layer *layer, float sparsity) {
+    int n = layer->dim.h * layer->dim.w;
+    int n_prune = (int) (sparsity * (float) n);
+    if (n_prune <= 0)
+        return;
+    if (n_prune > n)
+        n_prune = n;
+
+    float *mag = allocate_float_1d(n);
+    for (int i = 0; i < layer->dim.h; ++i)
+        for (int j = 0; j < layer->dim.w; ++j)
+            mag[i * layer->dim.w + j] = fabsf(layer->weights[i][j]);
+    qsort(mag, n, sizeof(float), compare_float);
+
+    float threshold = mag[n_prune - 1];
+    for (int i = 0; i < layer->dim.h; ++i)
+        for (int j = 0; j < layer->dim.w; ++j)
+            if (fabsf(layer->weights[i][j]) <= threshold)
+                layer->weights[i][j] = 0;
+
+    free_float_1d(mag);
+}
+
+
+/* Fraction of zero weights in a net */
+float net_sparsity(NeuralNet *ann) {
+    long zero = 0, total = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        for (int i = 0; i < iter->dim.h; ++i)
+            for (int j = 0; j < iter->dim.w; ++j)
+                zero += iter->weights[i][j] == 0;
+        total += (long) iter->dim.h * iter->dim.w;
+    }
+    return total > 0 ? (float) zero / (float) total : 0;
+}
+
+
+/* Keeps a sparsity in [0, 1], NaN counts as 0 */
+static float clamp_sparsity(float sparsity) {
+    return sparsity > 1 ? 1 : (sparsity > 0 ? sparsity : 0);
+}
+
+
+/* Magnitude pruning: zeroes the smallest weights of every layer, returns the sparsity reached.
+ * sparsity is clamped to [0, 1]. */
+float prune_net(NeuralNet *ann, float sparsity) {
+    sparsity = clamp_sparsity(sparsity);
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+        prune_layer(iter, sparsity);
+    net_changed(ann);
+    return net_sparsity(ann);
+}
+
+
+/* Prunes in n_rounds rounds up to sparsity with n_epoch fine-tuning epochs on X after each round.
+ * The report holds the sparsity and the accuracy of the dense and the sparse model on the held-out
+ * X_test, which must not overlap X. sparsity is clamped to [0, 1]. */
+void prune_and_finetune(NeuralNet *ann, float **X, float **y, Dim dim, float **X_test, float **y_test,
+                        Dim test_dim, float sparsity, int n_rounds, int n_epoch, PruneReport *report) {
+    sparsity = clamp_sparsity(sparsity);
+    EvalResult res;
+    eval_net(ann, X_test, y_test, test_dim, 1, &res);
+    report->dense_accuracy = res.accuracy;
+
+    int n_layers = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+        ++n_layers;
+    float ***mask = (float***) tann_alloc(sizeof(float**) * n_layers);
+
+    if (n_rounds < 1)
+        n_rounds = 1;
+    for (int r = 1; r <= n_rounds; ++r) {
+        float target = sparsity * (float) r / (float) n_rounds;
+        for (Layer *iter = ann->input; iter != NULL; iter = iter->next)
+            prune_layer(iter, target);
+
+        int l = 0;
+        for (Layer *iter = ann->input; iter != NULL; iter = iter->next, ++l) {
+            mask[l] = allocate_float_2d(iter->dim.h, iter->dim.w);
+            for (int i = 0; i < iter->dim.h; ++i)
+                for (int j = 0; j < iter->dim.w; ++j)
+                    mask[l][i][j] = iter->weights[i][j] != 0;
+        }
+
+        /* The surviving weights are tuned for the sparse net, the round gets one new version */
+        for (int step = 0; step < n_epoch; ++step)
+            train_epoch_masked(ann, X, y, dim, mask);
+        net_changed(ann);
+
+        l = 0;
+        for (Layer *iter = ann->input; iter != NULL; iter = iter->next, ++l)
+            free_float_2d(mask[l], iter->dim.h);
+    }
+    tann_free(mask);
+
+    SparseNet *net = sparse_net_from(ann);
+    report->sparsity = net_sparsity(ann);
+    report->block_sparsity = sparse_net_block_sparsity(net);
+    report->pruned_accuracy = sparse_net_accuracy(net, X_test, y_test, test_dim);
+    free_sparse_net(net);
+}
+
+
+/* Converts a (pruned) net into blocked sparse format */
+SparseNet *sparse_net_from(NeuralNet *ann) {
+    const int B = TANN_PRUNE_BLOCK;
+    SparseNet *net = (SparseNet*) tann_alloc(sizeof(SparseNet));
+    net->n_layers = 0;
+    net->max_width = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next) {
+        ++net->n_layers;
+        if (iter->dim.h > net->max_width)
+            net->max_width = iter->dim.h;
+        if (iter->dim.w > net->max_width)
+            net->max_width = iter->dim.w;
+    }
+    /* The last block of a row may reach past the width of the layer */
+    net->max_width = (net->max_width + B - 1) / B * B;
+    net->layers = (SparseLayer*) tann_alloc(sizeof(SparseLayer) * net->n_layers);
+
+    int l = 0;
+    for (Layer *iter = ann->input; iter != NULL; iter = iter->next, ++l) {
+        SparseLayer *sl = &net->layers[l];
+        int n_col_blocks = (iter->dim.w + B - 1) / B;
+        sl->dim = iter->dim;
+        sl->act = iter->act;
+        sl->n_blocks = 0;
+        sl->row_ptr = (int*) tann_alloc(sizeof(int) * (iter->dim.h + 1));
+
+        for (int pass = 0; pass < 2; ++pass) {
+            int p = 0;
+            for (int i = 0; i < iter->dim.h; ++i) {
+                sl->row_ptr[i] = p;
+                for (int b = 0; b < n_col_blocks; ++b) {
+                    int nonzero = 0;
+                    for (int k = b * B; k < b * B + B && k < iter->dim.w; ++k)
+                        nonzero |= iter->weights[i][k] != 0;
+                    if (!nonzero)
+                        continue;
+
+                    if (pass == 1) {
+                        sl->block_col[p] = b * B;
+                        for (int k = 0; k < B; ++k)
+                            sl->val[p * B + k] = b * B + k < iter->dim.w ? iter->weights[i][b * B + k] : 0;
+                    }
+                    ++p;
+                }
+            }
+            sl->row_ptr[iter->dim.h] = p;
+
+            if (pass == 0) {
+                sl->n_blocks = p;
+                sl->block_col = (int*) tann_alloc(sizeof(int) * (p > 0 ? p : 1));
+                sl->val = allocate_float_1d(p > 0 ? p * B : 1);
+            }
+        }
+    }
+
+    return net;
+}
+
+
+/* Free function for a sparse net */
+void free_sparse_net(SparseNet *net) {
+    for (int l = 0; l < net->n_layers; ++l) {
+        tann_free(net->layers[l].row_ptr);
+        tann_free(net->layers[l].block_col);
+        free_float_1d(net->layers[l].val);
+    }
+    tann_free(net->layers);
+    tann_free(net);
+}
+
+
+/* Fraction of weight blocks that were dropped */
+float sparse_net_block_sparsity(SparseNet *net) {
+    long kept = 0, total = 0;
+    for (int l = 0; l < net->n_layers; ++l) {
+        SparseLayer *sl = &net->layers[l];
+        kept += sl->n_blocks;
+        total += (long) sl->dim.h * ((sl->dim.w + TANN_PRUNE_BLOCK - 1) / TANN_PRUNE_BLOCK);
+    }
+    return total > 0 ? 1 - (float) kept / (float) total : 0;
+}
+
+
+/* Sparse mat-vec of a layer: y = x * W over the stored blocks only */
+static void sparse_layer_forward(SparseLayer *sl, const float *x, float *y) {
+    const int B = TANN_PRUNE_BLOCK;
+    fill_zero(y, (sl->dim.w + B - 1) / B * B);
+    for (int i = 0; i < sl->dim.h; ++i) {
+        float xi = x[i];
+        if (xi == 0)
+            continue;
+        for (int p = sl->row_ptr[i]; p < sl->row_ptr[i + 1]; ++p) {
+            float *dst = &y[sl->block_col[p]];
+            const float *v = &sl->val[p * B];
+            for (int k = 0; k < B; ++k)
+                dst[k] += xi * v[k];
+        }
+    }
+}
+
+
+/* Feeds forward a sample, buf_a and buf_b must hold max_width floats.
+ * Returns a pointer to the output, which is one of the two buffers. */
+float *sparse_net_forward(SparseNet *net, const float *x, float *buf_a, float *buf_b) {
+    const float *in = x;
+    float *out = buf_a;
+    for (int l = 0; l < net->n_layers; ++l) {
+        SparseLayer *sl = &net->layers[l];
+        sparse_layer_forward(sl, in, out);
+        activate(sl->act, out, out, sl->dim.w);
+        in = out;
+        out = out == buf_a ? buf_b : buf_a;
+    }
+    return (float*) in;
+}
+
+
+/* Sparse mat-mat: feeds forward n samples, out is an n x output width matrix.
+ * Every stored block is loaded once per layer for the whole batch. */
+void sparse_net_forward_batch(SparseNet *net, float **X, int n, float **out) {
+    const int B = TANN_PRUNE_BLOCK;
+    int w = net->max_width;
+    float *a = allocate_float_1d(n * w);
+    float *b = allocate_float_1d(n * w);
+    float *in = NULL, *res = a;
+
+    for (int l = 0; l < net->n_layers; ++l) {
+        SparseLayer *sl = &net->layers[l];
+        fill_zero(res, n * w);
+        for (int i = 0; i < sl->dim.h; ++i) {
+            for (int p = sl->row_ptr[i]; p < sl->row_ptr[i + 1]; ++p) {
+                const float *v = &sl->val[p * B];
+                int c = sl->block_col[p];
+                for (int s = 0; s < n; ++s) {
+                    float xi = in != NULL ? in[s * w + i] : X[s][i];
+                    float *dst = &res[s * w + c];
+                    for (int k = 0; k < B; ++k)
+                        dst[k] += xi * v[k];
+                }
+            }
+        }
+        for (int s = 0; s < n; ++s)
+            activate(sl->act, &res[s * w], &res[s * w], sl->dim.w);
+
+        in = res;
+        res = res == a ? b : a;
+    }
+
+    int n_out = net->layers[net->n_layers - 1].dim.w;
+    for (int s = 0; s < n; ++s)
+        memcpy(out[s], &in[s * w], sizeof(float) * n_out);
+
+    free_float_1d(a);
+    free_float_1d(b);
+}
+
+
+/* Accuracy of a sparse net on a dataset */
+float sparse_net_accuracy(SparseNet *net, float **X, float **y, Dim dim) {
+    float *a = allocate_float_1d(net->max_width);
+    float *b = allocate_float_1d(net->max_width);
+    SparseLayer *last = &net->layers[net->n_layers - 1];
+    int correct = 0;
+
+    for (int i = 0; i < dim.h; ++i) {
+        float *out = sparse_net_forward(net, X[i], a, b);
+        int pred = (int) (out[0] + 0.5);
+        if (last->act == ACT_SOFTMAX) {
+            pred = 0;
+            for (int k = 1; k < last->dim.w; ++k)
+                if (out[k] > out[pred])
+                    pred = k;
+        }
+        correct += pred == (int) y[i][0];
+    }
+
+    free_float_1d(a);
+    free_float_1d(b);
+    return dim.h > 0 ? (float) correct / (float) dim.h : 0;
+}
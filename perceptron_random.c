@@ -0,0 +1,141 @@
+/*
+ * This file contains the random number generator of the library. It is
+ * a xoshiro128** generator seeded through splitmix64, so any (seed,
+ * stream) pair gives an independent, reproducible stream. Every thread
+ * owns a default generator, so parallel code never shares generator
+ * state. rand_float(), the weight initialization and shuffle draw from
+ * the calling thread's generator. Its stream comes from an explicit
+ * index, never from the order the threads start in: a worker calls
+ * tann_seed_thread() with its own index, any other thread uses stream 0.
+ * Like the dataset generators, a parallel run is then reproducible.
+ *
+ */
+
+#include "perceptron.h"
+
+/* Lanes of the interleaved generator used by tann_rng_fill */
+#define FILL_LANES 8
+
+static uint64_t global_seed = 5489;
+static unsigned seed_generation = 1; /* renewed by tann_seed */
+static TANN_THREAD_LOCAL tann_rng thread_rng;
+static TANN_THREAD_LOCAL uint64_t thread_stream = 0;
+static TANN_THREAD_LOCAL unsigned thread_generation = 0; /* seed_generation thread_rng was seeded with */
+
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+static uint32_t rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+
+/* Seeds a generator, different streams of the same seed are independent */
+void tann_rng_seed(tann_rng *rng, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+    uint64_t a = splitmix64(&x);
+    uint64_t b = splitmix64(&x);
+    rng->s[0] = (uint32_t) a;
+    rng->s[1] = (uint32_t) (a >> 32);
+    rng->s[2] = (uint32_t) b;
+    rng->s[3] = (uint32_t) (b >> 32);
+    if ((rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]) == 0)
+        rng->s[0] = 1;
+}
+
+
+/* Next 32 random bits */
+uint32_t tann_rng_next(tann_rng *rng) {
+    uint32_t *s = rng->s;
+    uint32_t result = rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+    return result;
+}
+
+
+/* Random float in [0, 1) */
+float tann_rng_float(tann_rng *rng) {
+    return (float) (tann_rng_next(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+
+/* Fills an array with random floats in [0, 1). FILL_LANES generators seeded
+ * from rng run side by side in struct of arrays layout so the loop vectorizes. */
+void tann_rng_fill(tann_rng *rng, float *v, int n) {
+    uint32_t s0[FILL_LANES], s1[FILL_LANES], s2[FILL_LANES], s3[FILL_LANES];
+    for (int l = 0; l < FILL_LANES; ++l) {
+        s0[l] = tann_rng_next(rng);
+        s1[l] = tann_rng_next(rng) | 1;
+        s2[l] = tann_rng_next(rng);
+        s3[l] = tann_rng_next(rng);
+    }
+
+    int i = 0;
+    for (; i + FILL_LANES <= n; i += FILL_LANES) {
+        for (int l = 0; l < FILL_LANES; ++l) {
+            uint32_t result = rotl(s1[l] * 5, 7) * 9;
+            uint32_t t = s1[l] << 9;
+            s2[l] ^= s0[l];
+            s3[l] ^= s1[l];
+            s1[l] ^= s2[l];
+            s0[l] ^= s3[l];
+            s2[l] ^= t;
+            s3[l] = rotl(s3[l], 11);
+            v[i + l] = (float) (result >> 8) * (1.0f / 16777216.0f);
+        }
+    }
+    for (; i < n; ++i)
+        v[i] = tann_rng_float(rng);
+}
+
+
+static void reseed_thread(unsigned generation) {
+    tann_rng_seed(&thread_rng, __atomic_load_n(&global_seed, __ATOMIC_ACQUIRE), thread_stream);
+    thread_generation = generation;
+}
+
+
+/* Sets the global seed and puts the calling thread on stream 0 of it. Call it before any worker
+ * starts: a thread that draws while the seed changes may get numbers of either seed. Threads
+ * that already exist switch to the new seed at their next draw and keep their stream index. */
+void tann_seed(uint64_t seed) {
+    __atomic_store_n(&global_seed, seed, __ATOMIC_RELEASE);
+    unsigned generation = __atomic_add_fetch(&seed_generation, 1, __ATOMIC_ACQ_REL);
+    thread_stream = 0;
+    reseed_thread(generation);
+}
+
+
+/* Puts the calling thread on its own stream of the global seed. Workers pass their index
+ * (0, 1, ...), so their numbers don't depend on which thread started first. */
+void tann_seed_thread(uint32_t worker) {
+    thread_stream = (uint64_t) worker + 1;
+    reseed_thread(__atomic_load_n(&seed_generation, __ATOMIC_ACQUIRE));
+}
+
+
+/* Default generator of the calling thread, reseeded if tann_seed was called since its last use */
+tann_rng *tann_thread_rng() {
+    unsigned generation = __atomic_load_n(&seed_generation, __ATOMIC_ACQUIRE);
+    if (thread_generation != generation)
+        reseed_thread(generation);
+    return &thread_rng;
+}
+
+
+/* Next 32 random bits from the calling thread's stream */
+uint32_t tann_rand() {
+    return tann_rng_next(tann_thread_rng());
+}
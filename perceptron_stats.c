@@ -0,0 +1,211 @@
+/*
+ * This file contains the optional instrumentation layer of the library.
+ * Attach a tann_stats structure to a thread and feed_forward_net and
+ * train_net will record per-layer timings, throughput and heap
+ * allocations. Nothing is measured while no stats are attached. After
+ * tann_stats_enable_perf the hardware counters of the thread are read at
+ * the same points as the clock, so every layer also gets its cycles,
+ * instructions, cache and branch misses.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "perceptron.h"
+
+static TANN_THREAD_LOCAL tann_stats *active_stats = NULL;
+static TANN_THREAD_LOCAL tann_perf thread_perf;
+static TANN_THREAD_LOCAL int perf_enabled = 0;
+static TANN_THREAD_LOCAL long long perf_last[TANN_PERF_EVENTS];
+
+
+/* Monotonic wall clock time in seconds */
+double wall_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+
+/* Clears every counter */
+void tann_stats_reset(tann_stats *stats) {
+    memset(stats, 0, sizeof(tann_stats));
+}
+
+
+/* Starts collecting on the calling thread, NULL detaches */
+void tann_stats_attach(tann_stats *stats) {
+    active_stats = stats;
+}
+
+
+/* Stats attached to the calling thread or NULL */
+tann_stats *tann_stats_active() {
+    return active_stats;
+}
+
+
+/* Records a heap allocation */
+void tann_stats_count_alloc(size_t bytes) {
+    if (active_stats != NULL) {
+        active_stats->allocs++;
+        active_stats->alloc_bytes += (long) bytes;
+    }
+}
+
+
+/* Opens the hardware counters of the calling thread, returns how many of them work */
+int tann_stats_enable_perf(tann_stats *stats) {
+    if (!perf_enabled) {
+        tann_perf_open(&thread_perf);
+        perf_enabled = 1;
+    }
+    stats->perf_events = thread_perf.n_open;
+    return thread_perf.n_open;
+}
+
+
+/* Closes the hardware counters of the calling thread */
+void tann_stats_disable_perf() {
+    if (perf_enabled)
+        tann_perf_close(&thread_perf);
+    perf_enabled = 0;
+}
+
+
+/* wall_time() that also starts a new hardware counter interval */
+double tann_stats_clock(tann_stats *stats) {
+    (void) stats;
+    if (perf_enabled && thread_perf.n_open > 0)
+        tann_perf_read(&thread_perf, perf_last);
+    return wall_time();
+}
+
+
+/* Adds the counts since the last clock or the last layer to events */
+static void add_events(long long *events) {
+    if (!perf_enabled || thread_perf.n_open == 0)
+        return;
+
+    long long now[TANN_PERF_EVENTS];
+    tann_perf_read(&thread_perf, now);
+    for (int e = 0; e < TANN_PERF_EVENTS; ++e) {
+        if (now[e] >= 0 && perf_last[e] >= 0)
+            events[e] += now[e] - perf_last[e];
+        perf_last[e] = now[e];
+    }
+}
+
+
+void tann_stats_add_forward(tann_stats *stats, int layer, double sec) {
+    if (layer >= TANN_MAX_LAYERS)
+        return;
+    add_events(stats->layer[layer].forward_events);
+    stats->layer[layer].forward_sec += sec;
+    stats->layer[layer].forward_calls++;
+    if (layer >= stats->n_layers)
+        stats->n_layers = layer + 1;
+}
+
+
+void tann_stats_add_backward(tann_stats *stats, int layer, double sec) {
+    if (layer >= TANN_MAX_LAYERS)
+        return;
+    add_events(stats->layer[layer].backward_events);
+    stats->layer[layer].backward_sec += sec;
+    stats->layer[layer].backward_calls++;
+    if (layer >= stats->n_layers)
+        stats->n_layers = layer + 1;
+}
+
+
+/* Samples per second over the whole training time */
+static double samples_per_sec(const tann_stats *stats) {
+    return stats->train_sec > 0 ? (double) stats->samples / stats->train_sec : 0;
+}
+
+
+/* Heap allocations per training sample */
+static double allocs_per_step(const tann_stats *stats) {
+    return stats->samples > 0 ? (double) stats->allocs / (double) stats->samples : 0;
+}
+
+
+/* Dumps the counters as text */
+void tann_stats_print(FILE *file, const tann_stats *stats) {
+    fprintf(file, "Samples: %ld   Epochs: %ld   Training time: %0.3f sec   Last epoch: %0.3f sec\n",
+            stats->samples, stats->epochs, stats->train_sec, stats->last_epoch_sec);
+    fprintf(file, "Throughput: %0.1f samples/sec\n", samples_per_sec(stats));
+    fprintf(file, "Allocations: %ld (%ld bytes, %0.2f per step)\n",
+            stats->allocs, stats->alloc_bytes, allocs_per_step(stats));
+
+    for (int i = 0; i < stats->n_layers; ++i) {
+        const tann_layer_stats *l = &stats->layer[i];
+        fprintf(file, "Layer %d:   forward %0.6f sec (%ld calls)   backward %0.6f sec (%ld calls)\n",
+                i, l->forward_sec, l->forward_calls, l->backward_sec, l->backward_calls);
+    }
+    if (stats->perf_events > 0)
+        tann_stats_print_perf(file, stats, NULL);
+}
+
+
+/* Dumps the counters as JSON */
+void tann_stats_print_json(FILE *file, const tann_stats *stats) {
+    fprintf(file, "{\"samples\": %ld, \"epochs\": %ld, \"train_sec\": %f, \"last_epoch_sec\": %f, ",
+            stats->samples, stats->epochs, stats->train_sec, stats->last_epoch_sec);
+    fprintf(file, "\"samples_per_sec\": %f, \"allocs\": %ld, \"alloc_bytes\": %ld, \"allocs_per_step\": %f, ",
+            samples_per_sec(stats), stats->allocs, stats->alloc_bytes, allocs_per_step(stats));
+    fprintf(file, "\"layers\": [");
+
+    for (int i = 0; i < stats->n_layers; ++i) {
+        const tann_layer_stats *l = &stats->layer[i];
+        fprintf(file, "%s{\"forward_sec\": %f, \"forward_calls\": %ld, \"backward_sec\": %f, \"backward_calls\": %ld",
+                i > 0 ? ", " : "", l->forward_sec, l->forward_calls, l->backward_sec, l->backward_calls);
+        for (int e = 0; e < TANN_PERF_EVENTS && stats->perf_events > 0; ++e)
+            fprintf(file, ", \"forward_%s\": %lld, \"backward_%s\": %lld", tann_perf_event_name(e),
+                    l->forward_events[e], tann_perf_event_name(e), l->backward_events[e]);
+        fprintf(file, "}");
+    }
+    fprintf(file, "]}\n");
+}
+
+
+/* Ratio of two counters, 0 if either is missing */
+static double ratio(long long a, long long b) {
+    return a > 0 && b > 0 ? (double) a / (double) b : 0;
+}
+
+
+/* Prints one direction of a layer: IPC, misses per 1000 instructions and DRAM bytes per FLOP */
+static void print_layer_perf(FILE *file, const char *dir, const long long *ev, double flops) {
+    long long instr = ev[TANN_PERF_INSTRUCTIONS];
+    fprintf(file, "  %-8s cycles %lld   IPC %0.2f   L1D MPKI %0.2f   LLC MPKI %0.2f   branch MPKI %0.2f",
+            dir, ev[TANN_PERF_CYCLES], ratio(instr, ev[TANN_PERF_CYCLES]),
+            1000 * ratio(ev[TANN_PERF_L1D_MISSES], instr), 1000 * ratio(ev[TANN_PERF_LLC_MISSES], instr),
+            1000 * ratio(ev[TANN_PERF_BRANCH_MISSES], instr));
+    if (flops > 0 && ev[TANN_PERF_LLC_MISSES] >= 0)
+        fprintf(file, "   bytes/FLOP %0.4f", (double) ev[TANN_PERF_LLC_MISSES] * 64 / flops);
+    fprintf(file, "\n");
+}
+
+
+/* Per layer hardware counter report. With ann, the FLOPs of every layer give the DRAM
+ * bytes per FLOP (last level cache misses times the line size): a high value means
+ * the layer is memory bound. */
+void tann_stats_print_perf(FILE *file, const tann_stats *stats, NeuralNet *ann) {
+    if (stats->perf_events == 0) {
+        fprintf(file, "Hardware counters: unavailable\n");
+        return;
+    }
+
+    Layer *iter = ann != NULL ? ann->input : NULL;
+    for (int i = 0; i < stats->n_layers; ++i) {
+        const tann_layer_stats *l = &stats->layer[i];
+        /* A multiply-add is 2 FLOPs, backward computes the delta and the update */
+        double size = iter != NULL ? (double) iter->dim.h * iter->dim.w : 0;
+        fprintf(file, "Layer %d counters:\n", i);
+        print_layer_perf(file, "forward", l->forward_events, 2 * size * l->forward_calls);
+        print_layer_perf(file, "backward", l->backward_events, 4 * size * l->backward_calls);
+        if (iter != NULL)
+            iter = iter->next;
+    }
+}
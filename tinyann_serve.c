@@ -0,0 +1,603 @@
+/*
+ * tinyann_serve: a small inference daemon. It loads a net saved by
+ * save_net once and answers prediction requests over a Unix domain socket
+ * or stdin. A request is a line of comma separated features, the answer
+ * is a line with the outputs of the net. The line "stats" returns the
+ * p50/p99 latency and the throughput measured so far.
+ *
+ * The readers of every client push the requests into one queue. A single
+ * batcher thread takes them out in micro batches: it waits until the batch
+ * is full or the oldest request has used up the latency budget, minus the
+ * running average of the batch compute time, then runs the whole batch
+ * through feed_forward_batch_static and writes the answers back in order.
+ * Its buffers are allocated once and only grow when a reload brings wider
+ * layers, so serving a batch doesn't touch the heap.
+ *
+ * A model file may carry the feature pipeline of the net after the net
+ * itself (save_feature_pipeline). Requests then hold the raw columns the
+ * pipeline reads and every batch is expanded by feature_pipeline_apply
+ * before it reaches the net, so clients never repeat the expansion.
+ *
+ * SIGHUP reloads the model file. The new net is swapped in through a
+ * ModelHandle, so batches that are running finish on the old net and
+ * no request waits for the reload.
+ *
+ * Usage: tinyann_serve model.bin [-s socket_path] [-b max_batch] [-l budget_us]
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "perceptron.h"
+
+#define LINE_LEN 65536
+#define LATENCY_WINDOW 65536 /* latencies kept for the percentiles */
+#define DEFAULT_BATCH 64
+#define DEFAULT_BUDGET_US 1000
+
+
+typedef enum RequestKind {
+    REQ_PREDICT,
+    REQ_STATS,
+    REQ_ERROR
+} RequestKind;
+
+
+/* A connection, freed when its reader and every pending request are done */
+typedef struct Client {
+    int out_fd;
+    int owns_fd;
+    int refs;
+    FILE *in;
+    struct Server *srv;
+} Client;
+
+
+typedef struct Request {
+    RequestKind kind;
+    Client *client;
+    double arrival;
+    struct Request *next;
+    float x[]; /* features of a REQ_PREDICT */
+} Request;
+
+
+typedef struct Server {
+    ModelHandle *model;
+    const char *model_path;
+    FeaturePipeline *features; /* NULL if requests are fed to the net as they are */
+    int n_in, n_out; /* columns of a request and outputs of the net */
+    int n_net_in;
+    int max_batch;
+    double budget;
+    const char *socket_path;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Request *head, *tail;
+    int queued;
+    int stopping;
+    pthread_t batcher;
+
+    /* Only touched by the batcher thread */
+    int reader; /* slot of the batcher in the model handle */
+    float *buf_a, *buf_b; /* ping-pong buffers of feed_forward_batch_static */
+    int cap_a, cap_b; /* floats per sample they hold */
+    double compute_avg;
+    double first_arrival;
+    long n_served, n_batches;
+    float *latency_us;
+} Server;
+
+
+static void release_client(Client *c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_SEQ_CST) > 0)
+        return;
+    if (c->owns_fd)
+        close(c->out_fd);
+    free(c);
+}
+
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return; /* the client is gone, its answers are dropped */
+        buf += n;
+        len -= (size_t) n;
+    }
+}
+
+
+static int compare_float(const void *a, const void *b) {
+    float x = *(const float*) a, y = *(const float*) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Formats the latency percentiles and the throughput */
+static void format_stats(Server *srv, char *buf, size_t size) {
+    long n = srv->n_served < LATENCY_WINDOW ? srv->n_served : LATENCY_WINDOW;
+    float p50 = 0, p99 = 0;
+    if (n > 0) {
+        float *sorted = allocate_float_1d((int) n);
+        memcpy(sorted, srv->latency_us, sizeof(float) * n);
+        qsort(sorted, n, sizeof(float), compare_float);
+        p50 = sorted[n / 2];
+        p99 = sorted[(long) (n * 0.99)];
+        free_float_1d(sorted);
+    }
+
+    double elapsed = srv->n_served > 0 ? wall_time() - srv->first_arrival : 0;
+    snprintf(buf, size, "requests=%ld batches=%ld avg_batch=%.2f p50_us=%.1f p99_us=%.1f qps=%.1f\n",
+             srv->n_served, srv->n_batches,
+             srv->n_batches > 0 ? (double) srv->n_served / srv->n_batches : 0,
+             p50, p99, elapsed > 0 ? srv->n_served / elapsed : 0);
+}
+
+
+/* Sizes the batch buffers for the widest of the nets served so far */
+static void grow_buffers(Server *srv, const InferencePlan *plan) {
+    if (plan->buf_a > srv->cap_a)
+        srv->cap_a = plan->buf_a;
+    if (plan->buf_b > srv->cap_b)
+        srv->cap_b = plan->buf_b;
+    free_float_1d(srv->buf_a);
+    free_float_1d(srv->buf_b);
+    srv->buf_a = allocate_float_1d(srv->max_batch * srv->cap_a);
+    srv->buf_b = allocate_float_1d(srv->max_batch * srv->cap_b);
+}
+
+
+/* Runs one batch and answers every request of it in arrival order */
+static void process_batch(Server *srv, Request **batch, int n, float **X, float **F, float **Y) {
+    int m = 0;
+    double t = wall_time();
+    for (int i = 0; i < n; ++i)
+        if (batch[i]->kind == REQ_PREDICT)
+            X[m++] = batch[i]->x;
+    if (m > 0) {
+        if (srv->features != NULL)
+            feature_pipeline_apply(srv->features, X, F, m);
+        NeuralNet *ann = model_read_begin(srv->model, srv->reader);
+        /* A reloaded net may have wider hidden layers */
+        InferencePlan plan;
+        plan_inference(ann, &plan);
+        if (plan.buf_a > srv->cap_a || plan.buf_b > srv->cap_b)
+            grow_buffers(srv, &plan);
+        feed_forward_batch_static(ann, srv->features != NULL ? F : X, m, Y, srv->buf_a, srv->buf_b);
+        model_read_end(srv->model, srv->reader);
+        srv->compute_avg = 0.8 * srv->compute_avg + 0.2 * (wall_time() - t);
+        srv->n_batches++;
+    }
+
+    char buf[LINE_LEN];
+    m = 0;
+    for (int i = 0; i < n; ++i) {
+        Request *req = batch[i];
+        size_t len = 0;
+
+        if (req->kind == REQ_PREDICT) {
+            for (int k = 0; k < srv->n_out && len < sizeof(buf) - 32; ++k)
+                len += (size_t) snprintf(&buf[len], sizeof(buf) - len, k > 0 ? ",%g" : "%g", Y[m][k]);
+            buf[len++] = '\n';
+            ++m;
+        } else if (req->kind == REQ_STATS) {
+            format_stats(srv, buf, sizeof(buf));
+            len = strlen(buf);
+        } else {
+            len = (size_t) snprintf(buf, sizeof(buf), "error: expected %d comma separated features\n", srv->n_in);
+        }
+        write_all(req->client->out_fd, buf, len);
+
+        if (req->kind == REQ_PREDICT) {
+            if (srv->n_served == 0)
+                srv->first_arrival = req->arrival;
+            srv->latency_us[srv->n_served % LATENCY_WINDOW] = (float) ((wall_time() - req->arrival) * 1e6);
+            srv->n_served++;
+        }
+        release_client(req->client);
+        free(req);
+    }
+}
+
+
+static struct timespec to_timespec(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) t;
+    ts.tv_nsec = (long) ((t - (double) ts.tv_sec) * 1e9);
+    return ts;
+}
+
+
+/* Collects the queued requests into micro batches until the server stops */
+static void *batcher(void *arg) {
+    Server *srv = (Server*) arg;
+    Request **batch = (Request**) malloc(sizeof(Request*) * srv->max_batch);
+    float **X = (float**) malloc(sizeof(float*) * srv->max_batch);
+    float **F = srv->features != NULL ? allocate_float_2d(srv->max_batch, srv->n_net_in) : NULL;
+    float **Y = allocate_float_2d(srv->max_batch, srv->n_out);
+    srv->reader = model_reader_register(srv->model);
+    InferencePlan plan;
+    plan_inference(model_read_begin(srv->model, srv->reader), &plan);
+    model_read_end(srv->model, srv->reader);
+    grow_buffers(srv, &plan);
+
+    pthread_mutex_lock(&srv->lock);
+    for (;;) {
+        while (srv->head == NULL && !srv->stopping)
+            pthread_cond_wait(&srv->cond, &srv->lock);
+        if (srv->head == NULL)
+            break;
+
+        /* The oldest request waits at most the budget minus the time the batch will take */
+        double deadline = srv->head->arrival + srv->budget - srv->compute_avg;
+        while (srv->queued < srv->max_batch && !srv->stopping && wall_time() < deadline) {
+            struct timespec ts = to_timespec(deadline);
+            if (pthread_cond_timedwait(&srv->cond, &srv->lock, &ts) == ETIMEDOUT)
+                break;
+        }
+
+        int n = 0;
+        while (srv->head != NULL && n < srv->max_batch) {
+            batch[n++] = srv->head;
+            srv->head = srv->head->next;
+        }
+        if (srv->head == NULL)
+            srv->tail = NULL;
+        srv->queued -= n;
+
+        pthread_mutex_unlock(&srv->lock);
+        process_batch(srv, batch, n, X, F, Y);
+        pthread_mutex_lock(&srv->lock);
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    model_reader_unregister(srv->model, srv->reader);
+    free(batch);
+    free(X);
+    free_float_1d(srv->buf_a);
+    free_float_1d(srv->buf_b);
+    if (F != NULL)
+        free_float_2d(F, srv->max_batch);
+    free_float_2d(Y, srv->max_batch);
+    return NULL;
+}
+
+
+static void enqueue(Server *srv, Request *req) {
+    __atomic_add_fetch(&req->client->refs, 1, __ATOMIC_SEQ_CST);
+    req->next = NULL;
+    pthread_mutex_lock(&srv->lock);
+    if (srv->tail != NULL)
+        srv->tail->next = req;
+    else
+        srv->head = req;
+    srv->tail = req;
+    srv->queued++;
+    /* The batcher only has to wake up for the first request and for a full batch */
+    if (srv->queued == 1 || srv->queued >= srv->max_batch)
+        pthread_cond_signal(&srv->cond);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+
+/* Parses exactly n comma separated floats, returns 0 on success */
+static int parse_features(const char *line, float *x, int n) {
+    const char *p = line;
+    char *end;
+    for (int j = 0; j < n; ++j) {
+        x[j] = strtof(p, &end);
+        if (end == p)
+            return -1;
+        p = end;
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (j < n - 1) {
+            if (*p != ',')
+                return -1;
+            ++p;
+        }
+    }
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        ++p;
+    return *p == '\0' ? 0 : -1;
+}
+
+
+/* Reads the requests of one client without waiting for the answers, so clients can pipeline */
+static void *client_reader(void *arg) {
+    Client *c = (Client*) arg;
+    Server *srv = c->srv;
+    char *line = (char*) malloc(LINE_LEN);
+
+    while (fgets(line, LINE_LEN, c->in) != NULL) {
+        if (line[0] == '\n' || (line[0] == '\r' && line[1] == '\n'))
+            continue;
+
+        Request *req = (Request*) malloc(sizeof(Request) + sizeof(float) * srv->n_in);
+        req->client = c;
+        req->arrival = wall_time();
+        if (strncmp(line, "stats", 5) == 0)
+            req->kind = REQ_STATS;
+        else if (strchr(line, '\n') == NULL && !feof(c->in))
+            req->kind = REQ_ERROR; /* longer than LINE_LEN, the rest is read as another bad line */
+        else
+            req->kind = parse_features(line, req->x, srv->n_in) == 0 ? REQ_PREDICT : REQ_ERROR;
+        enqueue(srv, req);
+    }
+
+    free(line);
+    if (c->owns_fd)
+        fclose(c->in);
+    release_client(c);
+    return NULL;
+}
+
+
+static Client *create_client(Server *srv, FILE *in, int out_fd, int owns_fd) {
+    Client *c = (Client*) malloc(sizeof(Client));
+    c->in = in;
+    c->out_fd = out_fd;
+    c->owns_fd = owns_fd;
+    c->refs = 1;
+    c->srv = srv;
+    return c;
+}
+
+
+/* Drains the queue, stops the batcher and prints the final statistics. Called once, either by
+ * signal_waiter or by main after it has cancelled and joined signal_waiter. */
+static void stop_server(Server *srv) {
+    pthread_mutex_lock(&srv->lock);
+    srv->stopping = 1;
+    pthread_cond_broadcast(&srv->cond);
+    pthread_mutex_unlock(&srv->lock);
+    pthread_join(srv->batcher, NULL);
+
+    char buf[256];
+    format_stats(srv, buf, sizeof(buf));
+    fprintf(stderr, "tinyann_serve: %s", buf);
+    if (srv->socket_path != NULL)
+        unlink(srv->socket_path);
+}
+
+
+/* Loads a net and the feature pipeline that may follow it in the file, returns NULL on error */
+static NeuralNet *load_model(const char *path, FeaturePipeline **features) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    NeuralNet *ann = load_net(file);
+    *features = NULL;
+
+    int c = ann != NULL ? fgetc(file) : EOF;
+    if (c != EOF) {
+        ungetc(c, file);
+        *features = load_feature_pipeline(file);
+        if (*features == NULL || (*features)->in_w < 1 || (*features)->n_ops != ann->input->dim.h) {
+            if (*features != NULL)
+                free_feature_pipeline(*features);
+            *features = NULL;
+            free_net(ann);
+            ann = NULL;
+        }
+    }
+    fclose(file);
+    return ann;
+}
+
+
+static int same_pipeline(const FeaturePipeline *a, const FeaturePipeline *b) {
+    if (a == NULL || b == NULL)
+        return a == b;
+    if (a->n_ops != b->n_ops)
+        return 0;
+    for (int i = 0; i < a->n_ops; ++i)
+        if (a->ops[i].kind != b->ops[i].kind || a->ops[i].a != b->ops[i].a ||
+            a->ops[i].b != b->ops[i].b || a->ops[i].scale != b->ops[i].scale)
+            return 0;
+    return 1;
+}
+
+
+/* Loads the model file again and swaps it in if its shape and pipeline still fit the requests */
+static void reload_model(Server *srv) {
+    FeaturePipeline *features;
+    NeuralNet *ann = load_model(srv->model_path, &features);
+    if (ann == NULL) {
+        fprintf(stderr, "tinyann_serve: can't reload model %s\n", srv->model_path);
+        return;
+    }
+    /* The batcher reads the pipeline without a lock, so it can't change on a reload */
+    int same = same_pipeline(features, srv->features);
+    if (features != NULL)
+        free_feature_pipeline(features);
+    if (!same) {
+        fprintf(stderr, "tinyann_serve: %s has another feature pipeline, not reloaded\n", srv->model_path);
+        free_net(ann);
+        return;
+    }
+    if (ann->input->dim.h != srv->n_net_in || ann->output->dim.w != srv->n_out) {
+        fprintf(stderr, "tinyann_serve: %s has %d inputs and %d outputs instead of %d and %d, not reloaded\n",
+                srv->model_path, ann->input->dim.h, ann->output->dim.w, srv->n_net_in, srv->n_out);
+        free_net(ann);
+        return;
+    }
+    model_publish(srv->model, ann);
+    fprintf(stderr, "tinyann_serve: reloaded %s\n", srv->model_path);
+}
+
+
+/* Waits for SIGINT, SIGTERM and SIGHUP, which are blocked in every other thread */
+static void *signal_waiter(void *arg) {
+    Server *srv = (Server*) arg;
+    sigset_t set;
+    int sig;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    /* main cancels this thread in sigwait only, a reload or a stop runs to the end */
+    while (sigwait(&set, &sig) == 0 && sig == SIGHUP) {
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        reload_model(srv);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    stop_server(srv);
+    exit(0);
+}
+
+
+/* Accepts clients on a Unix domain socket, every client gets its own reader thread */
+static int serve_socket(Server *srv) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(srv->socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "tinyann_serve: invalid socket %s\n", srv->socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, srv->socket_path);
+    unlink(srv->socket_path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        fprintf(stderr, "tinyann_serve: can't listen on %s: %s\n", srv->socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fprintf(stderr, "tinyann_serve: listening on %s\n", srv->socket_path);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        int out_fd = dup(conn);
+        FILE *in = fdopen(conn, "r");
+        if (out_fd < 0 || in == NULL) {
+            close(conn);
+            if (out_fd >= 0)
+                close(out_fd);
+            continue;
+        }
+
+        pthread_t thread;
+        Client *c = create_client(srv, in, out_fd, 1);
+        if (pthread_create(&thread, &attr, client_reader, c) != 0) {
+            fclose(in);
+            release_client(c);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    close(fd);
+    return -1;
+}
+
+
+static void usage() {
+    fprintf(stderr, "Usage: tinyann_serve model.bin [-s socket_path] [-b max_batch] [-l budget_us]\n");
+}
+
+
+int main(int argc, char **argv) {
+    const char *model = NULL, *socket_path = NULL;
+    int max_batch = DEFAULT_BATCH;
+    long budget_us = DEFAULT_BUDGET_US;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            max_batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            budget_us = atol(argv[++i]);
+        else if (argv[i][0] != '-' && model == NULL)
+            model = argv[i];
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (model == NULL || max_batch < 1 || budget_us < 0) {
+        usage();
+        return 1;
+    }
+
+    FeaturePipeline *features;
+    NeuralNet *ann = load_model(model, &features);
+    if (ann == NULL) {
+        fprintf(stderr, "tinyann_serve: can't load model %s\n", model);
+        return 1;
+    }
+
+    Server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.model = create_model_handle(ann);
+    srv.model_path = model;
+    srv.features = features;
+    srv.n_net_in = ann->input->dim.h;
+    srv.n_in = features != NULL ? features->in_w : srv.n_net_in;
+    srv.n_out = ann->output->dim.w;
+    srv.max_batch = max_batch;
+    srv.budget = budget_us * 1e-6;
+    srv.socket_path = socket_path;
+    srv.latency_us = allocate_float_1d(LATENCY_WINDOW);
+
+    /* wall_time() is monotonic, so is the clock of the batch deadlines */
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&srv.cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&srv.lock, NULL);
+
+    /* Block the signals before any thread starts, only signal_waiter receives them */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t waiter;
+    if (pthread_create(&srv.batcher, NULL, batcher, &srv) != 0) {
+        fprintf(stderr, "tinyann_serve: can't start the batcher\n");
+        return 1;
+    }
+    if (pthread_create(&waiter, NULL, signal_waiter, &srv) != 0) {
+        fprintf(stderr, "tinyann_serve: can't start the signal handler\n");
+        stop_server(&srv);
+        return 1;
+    }
+
+    int status = 0;
+    if (socket_path != NULL)
+        status = serve_socket(&srv) == 0 ? 0 : 1;
+    else
+        client_reader(create_client(&srv, stdin, STDOUT_FILENO, 0));
+
+    /* If a signal is already stopping the server, the join never returns and the waiter exits */
+    pthread_cancel(waiter);
+    pthread_join(waiter, NULL);
+    stop_server(&srv);
+    free_float_1d(srv.latency_us);
+    free_model_handle(srv.model);
+    if (features != NULL)
+        free_feature_pipeline(features);
+    return status;
+}